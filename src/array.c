@@ -33,6 +33,18 @@ int array_length(void* array) {
     return (array != NULL) ? ARRAY_OCCUPIED(array) : 0;
 }
 
+int array_capacity(void* array) {
+    return (array != NULL) ? ARRAY_CAPACITY(array) : 0;
+}
+
+// Empties the array but keeps its memory, so it can be refilled without reallocating
+void* array_reset(void* array) {
+    if (array != NULL) {
+        ARRAY_OCCUPIED(array) = 0;
+    }
+    return array;
+}
+
 void array_free(void* array) {
     if (array != NULL) {
         free(ARRAY_RAW_DATA(array));
@@ -9,6 +9,8 @@
 
 void* array_hold(void* array, int count, int item_size);
 int array_length(void* array);
+int array_capacity(void* array);
+void* array_reset(void* array);
 void array_free(void* array);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "bounds.h"
+#include <math.h>
+
+aabb_t aabb_from_points(vec3_t* points, int count) {
+    aabb_t box = { {0, 0, 0}, {0, 0, 0} };
+    if (count == 0) {
+        return box;
+    }
+    box.min = points[0];
+    box.max = points[0];
+    for (int i = 1; i < count; i++) {
+        if (points[i].x < box.min.x) box.min.x = points[i].x;
+        if (points[i].y < box.min.y) box.min.y = points[i].y;
+        if (points[i].z < box.min.z) box.min.z = points[i].z;
+        if (points[i].x > box.max.x) box.max.x = points[i].x;
+        if (points[i].y > box.max.y) box.max.y = points[i].y;
+        if (points[i].z > box.max.z) box.max.z = points[i].z;
+    }
+    return box;
+}
+
+void aabb_get_corners(aabb_t box, vec3_t corners[8]) {
+    for (int i = 0; i < 8; i++) {
+        corners[i].x = (i & 1) ? box.max.x : box.min.x;
+        corners[i].y = (i & 2) ? box.max.y : box.min.y;
+        corners[i].z = (i & 4) ? box.max.z : box.min.z;
+    }
+}
+
+// Box around the transformed box: the center moves with the matrix and each new half
+// extent is the sum of the old ones weighted by the absolute values of the matrix
+aabb_t aabb_transform(aabb_t box, mat4_t matrix) {
+    float center[3] = { (box.min.x + box.max.x) * 0.5, (box.min.y + box.max.y) * 0.5, (box.min.z + box.max.z) * 0.5 };
+    float extent[3] = { (box.max.x - box.min.x) * 0.5, (box.max.y - box.min.y) * 0.5, (box.max.z - box.min.z) * 0.5 };
+    float new_center[3];
+    float new_extent[3];
+    for (int i = 0; i < 3; i++) {
+        new_center[i] = matrix.m[i][3];
+        new_extent[i] = 0;
+        for (int j = 0; j < 3; j++) {
+            new_center[i] += matrix.m[i][j] * center[j];
+            new_extent[i] += fabs(matrix.m[i][j]) * extent[j];
+        }
+    }
+    aabb_t result = {
+        .min = { new_center[0] - new_extent[0], new_center[1] - new_extent[1], new_center[2] - new_extent[2] },
+        .max = { new_center[0] + new_extent[0], new_center[1] + new_extent[1], new_center[2] + new_extent[2] }
+    };
+    return result;
+}
+
+// Sphere centered on the box of the points, with the radius of the farthest point
+sphere_t sphere_from_points(vec3_t* points, int count) {
+    aabb_t box = aabb_from_points(points, count);
+    sphere_t sphere = {
+        .center = vec3_mul(vec3_add(box.min, box.max), 0.5),
+        .radius = 0
+    };
+    for (int i = 0; i < count; i++) {
+        float distance = vec3_length(vec3_sub(points[i], sphere.center));
+        if (distance > sphere.radius) {
+            sphere.radius = distance;
+        }
+    }
+    return sphere;
+}
+
+// Moves the sphere by a matrix made of rotations, translations and a scale no bigger than max_scale
+sphere_t sphere_transform(sphere_t sphere, mat4_t matrix, float max_scale) {
+    sphere_t result = {
+        .center = vec3_from_vec4(mat4_mul_vec4(matrix, vec4_from_vec3(sphere.center))),
+        .radius = sphere.radius * max_scale
+    };
+    return result;
+}
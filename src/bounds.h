@@ -0,0 +1,26 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include "vector.h"
+#include "matrix.h"
+
+////////////////////////////////////////////////////////////////////////
+// Bounding volumes used to cull whole meshes before their faces are processed
+////////////////////////////////////////////////////////////////////////
+typedef struct {
+    vec3_t min;
+    vec3_t max;
+} aabb_t;
+
+typedef struct {
+    vec3_t center;
+    float radius;
+} sphere_t;
+
+aabb_t aabb_from_points(vec3_t* points, int count);
+void aabb_get_corners(aabb_t box, vec3_t corners[8]);
+aabb_t aabb_transform(aabb_t box, mat4_t matrix);
+sphere_t sphere_from_points(vec3_t* points, int count);
+sphere_t sphere_transform(sphere_t sphere, mat4_t matrix, float max_scale);
+
+#endif
@@ -0,0 +1,186 @@
+#include "bvh.h"
+#include "array.h"
+#include "clipping.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static aabb_t aabb_union(aabb_t a, aabb_t b) {
+    aabb_t result = {
+        .min = { fmin(a.min.x, b.min.x), fmin(a.min.y, b.min.y), fmin(a.min.z, b.min.z) },
+        .max = { fmax(a.max.x, b.max.x), fmax(a.max.y, b.max.y), fmax(a.max.z, b.max.z) }
+    };
+    return result;
+}
+
+static float aabb_center_axis(aabb_t box, int axis) {
+    switch (axis) {
+        case 0: return (box.min.x + box.max.x) * 0.5;
+        case 1: return (box.min.y + box.max.y) * 0.5;
+        default: return (box.min.z + box.max.z) * 0.5;
+    }
+}
+
+// qsort has no user pointer, the build sets these before sorting a range of objects
+static aabb_t* sort_bounds;
+static int sort_axis;
+
+static int compare_object_centers(const void* a, const void* b) {
+    float center_a = aabb_center_axis(sort_bounds[*(const int*)a], sort_axis);
+    float center_b = aabb_center_axis(sort_bounds[*(const int*)b], sort_axis);
+    return (center_a > center_b) - (center_a < center_b);
+}
+
+static aabb_t bounds_of_range(bvh_t* bvh, int first, int count) {
+    aabb_t bounds = bvh->object_bounds[bvh->object_indices[first]];
+    for (int i = 1; i < count; i++) {
+        bounds = aabb_union(bounds, bvh->object_bounds[bvh->object_indices[first + i]]);
+    }
+    return bounds;
+}
+
+// Splits the objects of a node in half along the longest axis of their centers until the leaves are small enough
+static void build_node(bvh_t* bvh, int node_index, int first, int count) {
+    bvh->nodes[node_index].bounds = bounds_of_range(bvh, first, count);
+
+    if (count <= BVH_MAX_LEAF_OBJECTS) {
+        bvh->nodes[node_index].first_object = first;
+        bvh->nodes[node_index].num_objects = count;
+        for (int i = 0; i < count; i++) {
+            bvh->object_leaves[bvh->object_indices[first + i]] = node_index;
+        }
+        return;
+    }
+
+    // Box around the object centers to pick the axis with the most spread
+    aabb_t centers = { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+    for (int i = 0; i < count; i++) {
+        aabb_t box = bvh->object_bounds[bvh->object_indices[first + i]];
+        vec3_t center = vec3_mul(vec3_add(box.min, box.max), 0.5);
+        aabb_t point = { center, center };
+        centers = aabb_union(centers, point);
+    }
+    vec3_t extent = vec3_sub(centers.max, centers.min);
+    sort_axis = 0;
+    if (extent.y > extent.x && extent.y >= extent.z) sort_axis = 1;
+    if (extent.z > extent.x && extent.z > extent.y) sort_axis = 2;
+    sort_bounds = bvh->object_bounds;
+    qsort(&bvh->object_indices[first], count, sizeof(int), compare_object_centers);
+
+    // Both children are pushed together so the right one is always left_child + 1
+    bvh_node_t child = { .parent = node_index, .left_child = -1, .first_object = 0, .num_objects = 0 };
+    int left_child = array_length(bvh->nodes);
+    array_push(bvh->nodes, child);
+    array_push(bvh->nodes, child);
+    bvh->nodes[node_index].left_child = left_child;
+    bvh->nodes[node_index].num_objects = 0;
+
+    int left_count = count / 2;
+    build_node(bvh, left_child, first, left_count);
+    build_node(bvh, left_child + 1, first + left_count, count - left_count);
+}
+
+void bvh_build(bvh_t* bvh, aabb_t* object_bounds, int num_objects) {
+    bvh_free(bvh);
+    bvh->num_objects = num_objects;
+    if (num_objects == 0) {
+        return;
+    }
+
+    bvh->object_bounds = (aabb_t*)malloc(sizeof(aabb_t) * num_objects);
+    bvh->object_indices = (int*)malloc(sizeof(int) * num_objects);
+    bvh->object_leaves = (int*)malloc(sizeof(int) * num_objects);
+    memcpy(bvh->object_bounds, object_bounds, sizeof(aabb_t) * num_objects);
+    for (int i = 0; i < num_objects; i++) {
+        bvh->object_indices[i] = i;
+    }
+
+    bvh_node_t root = { .parent = -1, .left_child = -1, .first_object = 0, .num_objects = 0 };
+    array_push(bvh->nodes, root);
+    build_node(bvh, 0, 0, num_objects);
+}
+
+// Updates the box of one object and grows or shrinks the boxes of its leaf and all of its ancestors
+void bvh_refit(bvh_t* bvh, int object_index, aabb_t bounds) {
+    bvh->object_bounds[object_index] = bounds;
+
+    int node_index = bvh->object_leaves[object_index];
+    bvh_node_t* leaf = &bvh->nodes[node_index];
+    leaf->bounds = bounds_of_range(bvh, leaf->first_object, leaf->num_objects);
+
+    node_index = leaf->parent;
+    while (node_index != -1) {
+        bvh_node_t* node = &bvh->nodes[node_index];
+        node->bounds = aabb_union(bvh->nodes[node->left_child].bounds, bvh->nodes[node->left_child + 1].bounds);
+        node_index = node->parent;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Hierarchical frustum culling
+///////////////////////////////////////////////////////////////////////////////
+// Nodes outside the frustum are skipped with everything below them and nodes
+// fully inside report all of their objects without testing them any further.
+// Only objects of partially visible leaves are tested one by one.
+///////////////////////////////////////////////////////////////////////////////
+static void add_node_objects(bvh_t* bvh, int node_index, bvh_visible_t visible[], int* num_visible) {
+    bvh_node_t* node = &bvh->nodes[node_index];
+    if (node->num_objects == 0) {
+        add_node_objects(bvh, node->left_child, visible, num_visible);
+        add_node_objects(bvh, node->left_child + 1, visible, num_visible);
+        return;
+    }
+    for (int i = 0; i < node->num_objects; i++) {
+        visible[*num_visible].object_index = bvh->object_indices[node->first_object + i];
+        visible[*num_visible].fully_inside = true;
+        (*num_visible)++;
+    }
+}
+
+static void cull_node(bvh_t* bvh, int node_index, bvh_visible_t visible[], int* num_visible) {
+    bvh_node_t* node = &bvh->nodes[node_index];
+    int visibility = frustum_test_world_aabb(node->bounds);
+    if (visibility == FRUSTUM_OUTSIDE) {
+        return;
+    }
+    if (visibility == FRUSTUM_INSIDE) {
+        add_node_objects(bvh, node_index, visible, num_visible);
+        return;
+    }
+    if (node->num_objects == 0) {
+        cull_node(bvh, node->left_child, visible, num_visible);
+        cull_node(bvh, node->left_child + 1, visible, num_visible);
+        return;
+    }
+    for (int i = 0; i < node->num_objects; i++) {
+        int object_index = bvh->object_indices[node->first_object + i];
+        int object_visibility = frustum_test_world_aabb(bvh->object_bounds[object_index]);
+        if (object_visibility == FRUSTUM_OUTSIDE) {
+            continue;
+        }
+        visible[*num_visible].object_index = object_index;
+        visible[*num_visible].fully_inside = object_visibility == FRUSTUM_INSIDE;
+        (*num_visible)++;
+    }
+}
+
+// visible must have room for every object of the hierarchy
+void bvh_cull(bvh_t* bvh, bvh_visible_t visible[], int* num_visible) {
+    *num_visible = 0;
+    if (bvh->num_objects == 0) {
+        return;
+    }
+    cull_node(bvh, 0, visible, num_visible);
+}
+
+void bvh_free(bvh_t* bvh) {
+    array_free(bvh->nodes);
+    free(bvh->object_indices);
+    free(bvh->object_leaves);
+    free(bvh->object_bounds);
+    bvh->nodes = NULL;
+    bvh->object_indices = NULL;
+    bvh->object_leaves = NULL;
+    bvh->object_bounds = NULL;
+    bvh->num_objects = 0;
+}
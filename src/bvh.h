@@ -0,0 +1,43 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdbool.h>
+#include "bounds.h"
+
+#define BVH_MAX_LEAF_OBJECTS 4
+
+////////////////////////////////////////////////////////////////////////
+// Bounding volume hierarchy over the world space boxes of scene objects
+////////////////////////////////////////////////////////////////////////
+// Inner nodes always have two children stored next to each other, leaves
+// point to a contiguous range of object_indices. Objects are referenced by
+// their index so the hierarchy does not care what they are.
+////////////////////////////////////////////////////////////////////////
+typedef struct {
+    aabb_t bounds;     // World space box around everything below this node
+    int parent;        // -1 for the root
+    int left_child;    // The right child is left_child + 1 (inner nodes only)
+    int first_object;  // First entry in object_indices (leaves only)
+    int num_objects;   // 0 for inner nodes
+} bvh_node_t;
+
+typedef struct {
+    bvh_node_t* nodes;      // Dynamic array of nodes, the root is nodes[0]
+    int* object_indices;    // Object indices ordered so that every leaf covers a contiguous range
+    int* object_leaves;     // Leaf node holding each object, used to refit after an object moves
+    aabb_t* object_bounds;  // World space box of each object
+    int num_objects;
+} bvh_t;
+
+// An object that passed frustum culling, fully_inside tells that none of it needs clipping
+typedef struct {
+    int object_index;
+    bool fully_inside;
+} bvh_visible_t;
+
+void bvh_build(bvh_t* bvh, aabb_t* object_bounds, int num_objects);
+void bvh_refit(bvh_t* bvh, int object_index, aabb_t bounds);
+void bvh_cull(bvh_t* bvh, bvh_visible_t visible[], int* num_visible);
+void bvh_free(bvh_t* bvh);
+
+#endif
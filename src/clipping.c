@@ -4,6 +4,13 @@
 #define NUM_PLANES 6
 plane_t frustum_planes[NUM_PLANES];
 
+// The same planes moved to world space with the current camera, used to cull world space boxes
+static plane_t world_frustum_planes[NUM_PLANES];
+
+// When enabled only the near and far planes are clipped geometrically, triangles that
+// cross the sides but stay inside the guard band are left to the rasterizer scissor
+static bool guard_band_clipping = true;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Frustum planes are defined by a point and a normal vector
 ///////////////////////////////////////////////////////////////////////////////
@@ -66,7 +73,160 @@ void init_frustum_planes(float fovx, float fovy, float z_near, float z_far) {
 	frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
 }
 
-polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2) {
+///////////////////////////////////////////////////////////////////////////////
+// Polygons are clipped in homogeneous clip space (after the projection matrix)
+///////////////////////////////////////////////////////////////////////////////
+// A clip space vertex is inside the frustum when:
+//   -w <= x <= w,   -w <= y <= w,   0 <= z <= w
+// Each plane gives a signed distance that is >= 0 on the inside, which is
+// used both for the outcodes and to find the intersection along an edge.
+// The camera space planes above describe the same frustum.
+///////////////////////////////////////////////////////////////////////////////
+static float clip_plane_distance(vec4_t v, int plane) {
+	switch (plane) {
+		case LEFT_FRUSTUM_PLANE: return v.w + v.x;
+		case RIGHT_FRUSTUM_PLANE: return v.w - v.x;
+		case TOP_FRUSTUM_PLANE: return v.w - v.y;
+		case BOTTOM_FRUSTUM_PLANE: return v.w + v.y;
+		case NEAR_FRUSTUM_PLANE: return v.z;
+		case FAR_FRUSTUM_PLANE: return v.w - v.z;
+	}
+	return 0;
+}
+
+uint16_t compute_outcode(vec4_t v) {
+	uint16_t outcode = 0;
+	if (v.w + v.x < 0) outcode |= OUTCODE_LEFT;
+	if (v.w - v.x < 0) outcode |= OUTCODE_RIGHT;
+	if (v.w - v.y < 0) outcode |= OUTCODE_TOP;
+	if (v.w + v.y < 0) outcode |= OUTCODE_BOTTOM;
+	if (v.z < 0) outcode |= OUTCODE_NEAR;
+	if (v.w - v.z < 0) outcode |= OUTCODE_FAR;
+
+	// Same side planes, pushed out by the guard band factor
+	float guard_w = v.w * GUARD_BAND_FACTOR;
+	if (guard_w + v.x < 0) outcode |= OUTCODE_GUARD_LEFT;
+	if (guard_w - v.x < 0) outcode |= OUTCODE_GUARD_RIGHT;
+	if (guard_w - v.y < 0) outcode |= OUTCODE_GUARD_TOP;
+	if (guard_w + v.y < 0) outcode |= OUTCODE_GUARD_BOTTOM;
+	return outcode;
+}
+
+void set_guard_band_clipping(bool enabled) {
+	guard_band_clipping = enabled;
+}
+
+bool is_guard_band_clipping(void) {
+	return guard_band_clipping;
+}
+
+// Returns the planes a triangle has to be clipped against given the OR of the outcodes of its vertices
+uint16_t get_clip_mask(uint16_t outcode) {
+	if (!guard_band_clipping) {
+		return outcode & OUTCODE_FRUSTUM_MASK;
+	}
+	// Near and far are always clipped, the sides only when the triangle leaves the guard band
+	uint16_t guard_mask = (outcode >> OUTCODE_GUARD_SHIFT) & (OUTCODE_LEFT | OUTCODE_RIGHT | OUTCODE_TOP | OUTCODE_BOTTOM);
+	return (outcode & (OUTCODE_NEAR | OUTCODE_FAR)) | guard_mask;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bounding volumes are tested against the camera space frustum planes
+///////////////////////////////////////////////////////////////////////////////
+// The signed distance of a point to a plane is dot(P - point, normal), which
+// is positive on the inside since every normal points into the frustum.
+///////////////////////////////////////////////////////////////////////////////
+static float plane_distance(plane_t* plane, vec3_t p) {
+	return vec3_dot(vec3_sub(p, plane->point), plane->normal);
+}
+
+// The sphere must already be in camera space
+int frustum_test_sphere(sphere_t sphere) {
+	int result = FRUSTUM_INSIDE;
+	for (int i = 0; i < NUM_PLANES; i++) {
+		float distance = plane_distance(&frustum_planes[i], sphere.center);
+		if (distance < -sphere.radius) {
+			return FRUSTUM_OUTSIDE;
+		}
+		if (distance < sphere.radius) {
+			result = FRUSTUM_INTERSECTING;
+		}
+	}
+	return result;
+}
+
+// The box is in model space, its corners are moved to camera space with the world view matrix
+int frustum_test_aabb(aabb_t box, mat4_t world_view_matrix) {
+	vec3_t corners[8];
+	aabb_get_corners(box, corners);
+	for (int i = 0; i < 8; i++) {
+		corners[i] = vec3_from_vec4(mat4_mul_vec4(world_view_matrix, vec4_from_vec3(corners[i])));
+	}
+
+	int result = FRUSTUM_INSIDE;
+	for (int i = 0; i < NUM_PLANES; i++) {
+		int num_outside = 0;
+		for (int j = 0; j < 8; j++) {
+			if (plane_distance(&frustum_planes[i], corners[j]) < 0) {
+				num_outside++;
+			}
+		}
+		if (num_outside == 8) {
+			return FRUSTUM_OUTSIDE;
+		}
+		if (num_outside > 0) {
+			result = FRUSTUM_INTERSECTING;
+		}
+	}
+	return result;
+}
+
+// The view matrix is a rotation R plus a translation t, so camera space points go back
+// to world space with R^T * (p - t) and normals with R^T * n
+void update_world_frustum_planes(mat4_t view_matrix) {
+	for (int i = 0; i < NUM_PLANES; i++) {
+		vec3_t point = frustum_planes[i].point;
+		vec3_t normal = frustum_planes[i].normal;
+		vec3_t p = {
+			point.x - view_matrix.m[0][3],
+			point.y - view_matrix.m[1][3],
+			point.z - view_matrix.m[2][3]
+		};
+		world_frustum_planes[i].point.x = view_matrix.m[0][0] * p.x + view_matrix.m[1][0] * p.y + view_matrix.m[2][0] * p.z;
+		world_frustum_planes[i].point.y = view_matrix.m[0][1] * p.x + view_matrix.m[1][1] * p.y + view_matrix.m[2][1] * p.z;
+		world_frustum_planes[i].point.z = view_matrix.m[0][2] * p.x + view_matrix.m[1][2] * p.y + view_matrix.m[2][2] * p.z;
+		world_frustum_planes[i].normal.x = view_matrix.m[0][0] * normal.x + view_matrix.m[1][0] * normal.y + view_matrix.m[2][0] * normal.z;
+		world_frustum_planes[i].normal.y = view_matrix.m[0][1] * normal.x + view_matrix.m[1][1] * normal.y + view_matrix.m[2][1] * normal.z;
+		world_frustum_planes[i].normal.z = view_matrix.m[0][2] * normal.x + view_matrix.m[1][2] * normal.y + view_matrix.m[2][2] * normal.z;
+	}
+}
+
+// Only the box corner farthest along each plane normal (and the one farthest against it) need testing
+int frustum_test_world_aabb(aabb_t box) {
+	int result = FRUSTUM_INSIDE;
+	for (int i = 0; i < NUM_PLANES; i++) {
+		plane_t* plane = &world_frustum_planes[i];
+		vec3_t positive = {
+			plane->normal.x >= 0 ? box.max.x : box.min.x,
+			plane->normal.y >= 0 ? box.max.y : box.min.y,
+			plane->normal.z >= 0 ? box.max.z : box.min.z
+		};
+		if (plane_distance(plane, positive) < 0) {
+			return FRUSTUM_OUTSIDE;
+		}
+		vec3_t negative = {
+			plane->normal.x >= 0 ? box.min.x : box.max.x,
+			plane->normal.y >= 0 ? box.min.y : box.max.y,
+			plane->normal.z >= 0 ? box.min.z : box.max.z
+		};
+		if (plane_distance(plane, negative) < 0) {
+			result = FRUSTUM_INTERSECTING;
+		}
+	}
+	return result;
+}
+
+polygon_t create_polygon_from_triangle(vec4_t v0, vec4_t v1, vec4_t v2, tex2_t t0, tex2_t t1, tex2_t t2) {
 	polygon_t polygon = {
 		.vertices = { v0, v1, v2 },
 		.texcoords = { t0, t1, t2 },
@@ -81,9 +241,9 @@ void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int* num
 		int index1 = i + 1;
 		int index2 = i + 2;
 
-		triangles[i].points[0] = vec4_from_vec3(polygon->vertices[index0]);
-		triangles[i].points[1] = vec4_from_vec3(polygon->vertices[index1]);
-		triangles[i].points[2] = vec4_from_vec3(polygon->vertices[index2]);
+		triangles[i].points[0] = polygon->vertices[index0];
+		triangles[i].points[1] = polygon->vertices[index1];
+		triangles[i].points[2] = polygon->vertices[index2];
 
 		triangles[i].texcoords[0] = polygon->texcoords[index0];
 		triangles[i].texcoords[1] = polygon->texcoords[index1];
@@ -97,47 +257,45 @@ float float_lerp(float a, float b, float t) {
 }
 
 void clip_polygon_against_plane(polygon_t* polygon, int plane){
-	vec3_t plane_point = frustum_planes[plane].point;
-	vec3_t plane_normal = frustum_planes[plane].normal;
-
 	// the arrayof inside vertices that will be part of the final polygon returned via out parameter(polygon)
-	vec3_t inside_vertices[MAX_NUM_POLY_VERTICES];
+	vec4_t inside_vertices[MAX_NUM_POLY_VERTICES];
 	tex2_t inside_texcoords[MAX_NUM_POLY_VERTICES];
 	int num_inside_vertices = 0;
 
-	vec3_t* current_vertex = &polygon->vertices[0];
+	vec4_t* current_vertex = &polygon->vertices[0];
 	tex2_t* current_texcoord = &polygon->texcoords[0];
 
-	vec3_t* previous_vertex = &polygon->vertices[polygon->num_vertices - 1];
+	vec4_t* previous_vertex = &polygon->vertices[polygon->num_vertices - 1];
 	tex2_t* previous_texcoord = &polygon->texcoords[polygon->num_vertices - 1];
 
-	// Dotq1 = dot(planeN, q1-p)
+	// Signed distance of the vertices to the plane, positive on the inside
 	float current_dot = 0;
-	float previous_dot = vec3_dot(vec3_sub(*previous_vertex, plane_point), plane_normal);
+	float previous_dot = clip_plane_distance(*previous_vertex, plane);
 
 	while(current_vertex != &polygon->vertices[polygon->num_vertices]) {
-		current_dot = vec3_dot(vec3_sub(*current_vertex, plane_point), plane_normal);
+		current_dot = clip_plane_distance(*current_vertex, plane);
 		// if we changed from inside to outside or vice-versa
-		if (current_dot * previous_dot < 0) {
+		if ((current_dot >= 0) != (previous_dot >= 0)) {
 			// t = dotq1 / (dotq1 - dotq2)
 			float t = previous_dot / (previous_dot - current_dot);
 			// intersection point I = q1 + t(q2-q1)
-			vec3_t intersection_point = {
+			vec4_t intersection_point = {
 				.x = float_lerp(previous_vertex->x, current_vertex->x, t),
 				.y = float_lerp(previous_vertex->y, current_vertex->y, t),
 				.z = float_lerp(previous_vertex->z, current_vertex->z, t),
+				.w = float_lerp(previous_vertex->w, current_vertex->w, t),
 			};
 			tex2_t interpolated_texcoord = {
 				.u = float_lerp(previous_texcoord->u, current_texcoord->u, t),
 				.v = float_lerp(previous_texcoord->v, current_texcoord->v, t)
 			};
 			inside_texcoords[num_inside_vertices] = tex2_clone(&interpolated_texcoord);
-			inside_vertices[num_inside_vertices] = vec3_clone(&intersection_point);	
+			inside_vertices[num_inside_vertices] = intersection_point;
 			num_inside_vertices++;
 		}
 
-		if(current_dot > 0) {
-			inside_vertices[num_inside_vertices] = vec3_clone(current_vertex);
+		if(current_dot >= 0) {
+			inside_vertices[num_inside_vertices] = *current_vertex;
 			inside_texcoords[num_inside_vertices] = tex2_clone(current_texcoord);
 			num_inside_vertices++;
 		}
@@ -149,17 +307,17 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane){
 		current_texcoord++;
 	}
 	for (int i = 0; i < num_inside_vertices; i++) {
-		polygon->vertices[i] = vec3_clone(&inside_vertices[i]);
+		polygon->vertices[i] = inside_vertices[i];
 		polygon->texcoords[i] = tex2_clone(&inside_texcoords[i]);
 	}
 	polygon->num_vertices = num_inside_vertices;
 }
 
-void clip_polygon(polygon_t* polygon) {
-	clip_polygon_against_plane(polygon, LEFT_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, RIGHT_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, TOP_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, BOTTOM_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
-	clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
-}
\ No newline at end of file
+// Clip the polygon only against the planes set in clip_mask (the OR of the outcodes of its vertices)
+void clip_polygon(polygon_t* polygon, uint16_t clip_mask) {
+	for (int plane = 0; plane < NUM_PLANES && polygon->num_vertices > 0; plane++) {
+		if (clip_mask & (1 << plane)) {
+			clip_polygon_against_plane(polygon, plane);
+		}
+	}
+}
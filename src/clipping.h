@@ -1,9 +1,12 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "vector.h"
 #include "triangle.h"
 #include "texture.h"
+#include "bounds.h"
 
 #define MAX_NUM_POLY_VERTICES 10
 #define MAX_NUM_POLY_TRIANGLES 10
@@ -17,6 +20,33 @@ enum {
     FAR_FRUSTUM_PLANE,
 };
 
+// Outcode bits, a bit is set when a clip space vertex lies outside that frustum plane
+#define OUTCODE_LEFT (1 << LEFT_FRUSTUM_PLANE)
+#define OUTCODE_RIGHT (1 << RIGHT_FRUSTUM_PLANE)
+#define OUTCODE_TOP (1 << TOP_FRUSTUM_PLANE)
+#define OUTCODE_BOTTOM (1 << BOTTOM_FRUSTUM_PLANE)
+#define OUTCODE_NEAR (1 << NEAR_FRUSTUM_PLANE)
+#define OUTCODE_FAR (1 << FAR_FRUSTUM_PLANE)
+
+// Guard band outcode bits, set when a vertex is also outside the enlarged left/right/top/bottom planes
+// They follow the same order as the frustum bits, shifted by OUTCODE_GUARD_SHIFT
+#define OUTCODE_GUARD_SHIFT 6
+#define OUTCODE_GUARD_LEFT (OUTCODE_LEFT << OUTCODE_GUARD_SHIFT)
+#define OUTCODE_GUARD_RIGHT (OUTCODE_RIGHT << OUTCODE_GUARD_SHIFT)
+#define OUTCODE_GUARD_TOP (OUTCODE_TOP << OUTCODE_GUARD_SHIFT)
+#define OUTCODE_GUARD_BOTTOM (OUTCODE_BOTTOM << OUTCODE_GUARD_SHIFT)
+#define OUTCODE_FRUSTUM_MASK 0x3F
+
+// How many times larger than the screen the guard band is, in each direction from the center
+#define GUARD_BAND_FACTOR 4.0
+
+// Result of testing a bounding volume against the frustum
+enum {
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTING,
+    FRUSTUM_INSIDE,
+};
+
 typedef struct {
     vec3_t point;
     vec3_t normal;
@@ -24,14 +54,22 @@ typedef struct {
 } plane_t;
 
 typedef struct {
-    vec3_t vertices[MAX_NUM_POLY_VERTICES];
+    vec4_t vertices[MAX_NUM_POLY_VERTICES]; // Clip space vertices
     tex2_t texcoords[MAX_NUM_POLY_VERTICES];
     int num_vertices;
 } polygon_t;
 
-void clip_polygon(polygon_t* polygon);
+uint16_t compute_outcode(vec4_t v);
+uint16_t get_clip_mask(uint16_t outcode);
+void clip_polygon(polygon_t* polygon, uint16_t clip_mask);
 void init_frustum_planes(float fovx, float fovy, float z_near, float z_far);
+int frustum_test_sphere(sphere_t sphere);
+int frustum_test_aabb(aabb_t box, mat4_t world_view_matrix);
+void update_world_frustum_planes(mat4_t view_matrix);
+int frustum_test_world_aabb(aabb_t box);
+void set_guard_band_clipping(bool enabled);
+bool is_guard_band_clipping(void);
 void triangles_from_polygon(polygon_t* polygon, triangle_t triangles[], int* num_of_triangles);
-polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
+polygon_t create_polygon_from_triangle(vec4_t v0, vec4_t v1, vec4_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+#include "cpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(CPU_X86)
+#include <cpuid.h>
+#endif
+
+static cpu_path_t best_path = CPU_PATH_SCALAR;
+static cpu_path_t active_path = CPU_PATH_SCALAR;
+
+static const char* path_names[] = {"scalar", "sse2", "sse4.1", "avx2", "avx512"};
+
+#if defined(CPU_X86)
+// Register state the OS saves on context switches, the AVX registers are only usable if it saves them
+static unsigned long long read_xcr0(void) {
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+}
+
+static cpu_path_t detect_cpu_path(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return CPU_PATH_SCALAR;
+    }
+    bool has_sse2 = edx & (1 << 26);
+    bool has_sse41 = ecx & (1 << 19);
+    bool has_osxsave = ecx & (1 << 27);
+    bool has_avx = ecx & (1 << 28);
+
+    bool has_avx2 = false;
+    bool has_avx512 = false;
+    if (has_osxsave && has_avx && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        unsigned long long xcr0 = read_xcr0();
+        bool os_saves_ymm = (xcr0 & 0x6) == 0x6;    // SSE and AVX state
+        bool os_saves_zmm = (xcr0 & 0xE6) == 0xE6;  // Plus the opmask and upper ZMM state
+        has_avx2 = os_saves_ymm && (ebx & (1 << 5));
+        has_avx512 = has_avx2 && os_saves_zmm && (ebx & (1 << 16));
+    }
+
+    if (has_avx512) return CPU_PATH_AVX512;
+    if (has_avx2) return CPU_PATH_AVX2;
+    if (has_sse41) return CPU_PATH_SSE41;
+    if (has_sse2) return CPU_PATH_SSE2;
+    return CPU_PATH_SCALAR;
+}
+#else
+static cpu_path_t detect_cpu_path(void) {
+    return CPU_PATH_SCALAR;
+}
+#endif
+
+void init_cpu_dispatch(void) {
+    best_path = detect_cpu_path();
+    active_path = best_path;
+
+    const char* forced = getenv("RENDERER_CPU_PATH");
+    if (forced != NULL) {
+        for (int i = CPU_PATH_SCALAR; i <= CPU_PATH_AVX512; i++) {
+            if (strcmp(forced, path_names[i]) == 0) {
+                set_cpu_path(i);
+            }
+        }
+    }
+}
+
+cpu_path_t get_cpu_path(void) {
+    return active_path;
+}
+
+cpu_path_t get_best_cpu_path(void) {
+    return best_path;
+}
+
+// A path the CPU does not support is lowered to the best one it does, returns the path that is used
+cpu_path_t set_cpu_path(cpu_path_t path) {
+    active_path = path > best_path ? best_path : path;
+    return active_path;
+}
+
+const char* get_cpu_path_name(cpu_path_t path) {
+    return path_names[path];
+}
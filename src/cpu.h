@@ -0,0 +1,37 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////
+// Runtime selection of the SIMD kernels
+////////////////////////////////////////////////////////////////////////
+// The CPU is queried once at startup and the best instruction set it (and
+// the OS) supports becomes the active path. Kernels compiled for a higher
+// path than the active one are never called, so a single binary built for
+// plain x86-64 still uses AVX2 where it is available. The path can be
+// forced lower for testing with set_cpu_path or the RENDERER_CPU_PATH
+// environment variable (scalar, sse2, sse4.1, avx2, avx512).
+////////////////////////////////////////////////////////////////////////
+typedef enum
+{
+    CPU_PATH_SCALAR,
+    CPU_PATH_SSE2,
+    CPU_PATH_SSE41,
+    CPU_PATH_AVX2,
+    CPU_PATH_AVX512
+} cpu_path_t;
+
+// Kernels for a given instruction set are only compiled on x86 with GCC or Clang, with the target attribute
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86 1
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+void init_cpu_dispatch(void);
+cpu_path_t get_cpu_path(void);
+cpu_path_t get_best_cpu_path(void);
+cpu_path_t set_cpu_path(cpu_path_t path);
+const char* get_cpu_path_name(cpu_path_t path);
+
+#endif
@@ -1,10 +1,19 @@
 #include "display.h"
+#include "cpu.h"
+#include <string.h>
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#endif
 
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
 
 static uint32_t *color_buffer = NULL;
 static float *z_buffer = NULL;
+static uint32_t *id_buffer = NULL; // Triangle covering every pixel, only used by the visibility buffer mode
+static float *z_block_max = NULL; // Farthest depth of every block of the depth buffer
+static int z_blocks_per_row;
 
 static SDL_Texture *color_buffer_texture = NULL;
 static int window_width;
@@ -20,6 +29,11 @@ int get_window_height(void)
 {
     return window_height;
 }
+rect_t get_screen_rect(void)
+{
+    rect_t rect = {0, 0, window_width, window_height};
+    return rect;
+}
 void set_render_method(int method)
 {
     render_mode = method;
@@ -40,6 +54,79 @@ bool should_render_filled_triangle(void)
 {
     return (render_mode == Filled || render_mode == FilledWireframe);
 }
+bool should_render_visibility_buffer(void)
+{
+    return render_mode == RenderVisibilityBuffer;
+}
+
+// Direct access for the rasterizer inner loops, row major with get_window_width() pixels per row
+uint32_t *get_color_buffer(void)
+{
+    return color_buffer;
+}
+float *get_z_buffer(void)
+{
+    return z_buffer;
+}
+uint32_t *get_id_buffer(void)
+{
+    return id_buffer;
+}
+
+// Farthest depth of every block, get_z_blocks_per_row blocks per row
+float *get_z_block_max(void)
+{
+    return z_block_max;
+}
+
+int get_z_blocks_per_row(void)
+{
+    return z_blocks_per_row;
+}
+
+// Must be called after pixels of the block were written, depths only ever get nearer so the max can only drop
+void update_z_block_max(int block_x, int block_y)
+{
+    int x_start = block_x * Z_BLOCK_SIZE;
+    int y_start = block_y * Z_BLOCK_SIZE;
+    int x_end = x_start + Z_BLOCK_SIZE < window_width ? x_start + Z_BLOCK_SIZE : window_width;
+    int y_end = y_start + Z_BLOCK_SIZE < window_height ? y_start + Z_BLOCK_SIZE : window_height;
+
+    // Take the max of the columns first, the rows of a whole block are a fixed size the compiler can vectorize
+    float column_max[Z_BLOCK_SIZE];
+    float *z_row = &z_buffer[(y_start * window_width) + x_start];
+    int width = x_end - x_start;
+    // Columns past the right edge of the screen repeat the last one, they cannot raise the max
+    for (int x = 0; x < Z_BLOCK_SIZE; x++)
+    {
+        column_max[x] = z_row[x < width ? x : width - 1];
+    }
+    for (int y = y_start + 1; y < y_end; y++)
+    {
+        z_row += window_width;
+        if (width == Z_BLOCK_SIZE)
+        {
+            for (int x = 0; x < Z_BLOCK_SIZE; x++)
+            {
+                column_max[x] = z_row[x] > column_max[x] ? z_row[x] : column_max[x];
+            }
+        }
+        else
+        {
+            for (int x = 0; x < width; x++)
+            {
+                column_max[x] = z_row[x] > column_max[x] ? z_row[x] : column_max[x];
+            }
+        }
+    }
+
+    float max_depth = column_max[0];
+    for (int x = 1; x < width; x++)
+    {
+        max_depth = column_max[x] > max_depth ? column_max[x] : max_depth;
+    }
+    z_block_max[(block_y * z_blocks_per_row) + block_x] = max_depth;
+}
 
 float get_zbuffer_at(int x, int y)
 {
@@ -103,6 +190,10 @@ bool initialize_window(void)
     color_buffer = (uint32_t *)malloc(sizeof(uint32_t) * window_width * window_height);
     // Allocate the required memory for the zbuffer
     z_buffer = (float *)malloc(sizeof(float) * window_width * window_height);
+    id_buffer = (uint32_t *)malloc(sizeof(uint32_t) * window_width * window_height);
+    z_blocks_per_row = (window_width + Z_BLOCK_SIZE - 1) / Z_BLOCK_SIZE;
+    int z_blocks_per_column = (window_height + Z_BLOCK_SIZE - 1) / Z_BLOCK_SIZE;
+    z_block_max = (float *)malloc(sizeof(float) * z_blocks_per_row * z_blocks_per_column);
 
     // Creating a SDL texture that is used to display the color buffer
     color_buffer_texture = SDL_CreateTexture(
@@ -124,27 +215,34 @@ void draw_pixel(int x, int y, uint32_t color)
     color_buffer[(window_width * y) + x] = color;
 }
 
-void draw_rect(int x, int y, int width, int height, uint32_t color)
+void draw_rect(int x, int y, int width, int height, uint32_t color, rect_t clip)
 {
-    for (int i = 0; i < width; i++)
+    // Only the part of the rectangle inside the clip rect
+    int x_start = x > clip.x_min ? x : clip.x_min;
+    int y_start = y > clip.y_min ? y : clip.y_min;
+    int x_end = x + width < clip.x_max ? x + width : clip.x_max;
+    int y_end = y + height < clip.y_max ? y + height : clip.y_max;
+
+    for (int current_x = x_start; current_x < x_end; current_x++)
     {
-        for (int j = 0; j < height; j++)
+        for (int current_y = y_start; current_y < y_end; current_y++)
         {
-            int current_x = x + i;
-            int current_y = y + j;
             draw_pixel(current_x, current_y, color);
         }
     }
 }
 
-void draw_grid(void)
+void draw_grid(rect_t rect)
 {
     // Draw a background that fills the entire window
     // lines should be rendererd at every row/col multiple by 10
+    // Start from the first multiple of 10 inside the rect
+    int y_start = (rect.y_min + 9) / 10 * 10;
+    int x_start = (rect.x_min + 9) / 10 * 10;
 
-    for (int y = 0; y < window_height; y += 10)
+    for (int y = y_start; y < rect.y_max; y += 10)
     {
-        for (int x = 0; x < window_width; x += 10)
+        for (int x = x_start; x < rect.x_max; x += 10)
         {
             if (y % 10 == 0 || x % 10 == 0)
             {
@@ -154,7 +252,7 @@ void draw_grid(void)
     }
 }
 
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color)
+void draw_line(int x0, int y0, int x1, int y1, uint32_t color, rect_t clip)
 {
     int delta_x = (x1 - x0);
     int delta_y = (y1 - y0);
@@ -169,7 +267,13 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color)
     float current_y = y0;
     for (int i = 0; i <= side_length; i++)
     {
-        draw_pixel(round(current_x), round(current_y), color);
+        // The steps are the same whatever the clip rect, only the pixels outside of it are skipped
+        int x = round(current_x);
+        int y = round(current_y);
+        if (x >= clip.x_min && x < clip.x_max && y >= clip.y_min && y < clip.y_max)
+        {
+            draw_pixel(x, y, color);
+        }
         current_x += inc_x;
         current_y += inc_y;
     }
@@ -193,19 +297,97 @@ void render_color_buffer(void)
     SDL_RenderPresent(renderer);
 }
 
-void clear_color_buffer(uint32_t color)
+// Fill count 32 bit values of a row, used by the clears of both buffers
+static void fill_row_scalar(uint32_t *row, int count, uint32_t value)
 {
-    for (int i = 0; i < window_width * window_height; i++)
+    for (int i = 0; i < count; i++)
     {
-        color_buffer[i] = color;
+        row[i] = value;
     }
 }
 
-void clear_z_buffer(void)
+#if defined(CPU_X86)
+CPU_TARGET("sse2")
+static void fill_row_sse2(uint32_t *row, int count, uint32_t value)
 {
-    for (int i = 0; i < window_width * window_height; i++)
+    __m128i values = _mm_set1_epi32(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
     {
-        z_buffer[i] = 1.0;
+        _mm_storeu_si128((__m128i *)&row[i], values);
+    }
+    fill_row_scalar(&row[i], count - i, value);
+}
+
+CPU_TARGET("avx2")
+static void fill_row_avx2(uint32_t *row, int count, uint32_t value)
+{
+    __m256i values = _mm256_set1_epi32(value);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm256_storeu_si256((__m256i *)&row[i], values);
+    }
+    fill_row_scalar(&row[i], count - i, value);
+}
+
+CPU_TARGET("avx512f")
+static void fill_row_avx512(uint32_t *row, int count, uint32_t value)
+{
+    __m512i values = _mm512_set1_epi32(value);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        _mm512_storeu_si512(&row[i], values);
+    }
+    // The last partial block is a masked store
+    __mmask16 tail = (__mmask16)((1u << (count - i)) - 1);
+    _mm512_mask_storeu_epi32(&row[i], tail, values);
+}
+#endif
+
+static void fill_rect(uint32_t *buffer, rect_t rect, uint32_t value)
+{
+    void (*fill_row)(uint32_t *row, int count, uint32_t value) = fill_row_scalar;
+#if defined(CPU_X86)
+    if (get_cpu_path() >= CPU_PATH_AVX512)
+        fill_row = fill_row_avx512;
+    else if (get_cpu_path() >= CPU_PATH_AVX2)
+        fill_row = fill_row_avx2;
+    else if (get_cpu_path() >= CPU_PATH_SSE2)
+        fill_row = fill_row_sse2;
+#endif
+    for (int y = rect.y_min; y < rect.y_max; y++)
+    {
+        fill_row(&buffer[(window_width * y) + rect.x_min], rect.x_max - rect.x_min, value);
+    }
+}
+
+void clear_color_buffer(uint32_t color, rect_t rect)
+{
+    fill_rect(color_buffer, rect, color);
+}
+
+void clear_id_buffer(rect_t rect)
+{
+    fill_rect(id_buffer, rect, NO_TRIANGLE_ID);
+}
+
+void clear_z_buffer(rect_t rect)
+{
+    // The depth buffer is cleared with the bits of 1.0
+    float depth = 1.0;
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &depth, sizeof(depth_bits));
+    fill_rect((uint32_t *)z_buffer, rect, depth_bits);
+
+    // Reset the blocks of the rect, rects are aligned to the blocks except at the right and bottom of the screen
+    for (int block_y = rect.y_min / Z_BLOCK_SIZE; block_y * Z_BLOCK_SIZE < rect.y_max; block_y++)
+    {
+        for (int block_x = rect.x_min / Z_BLOCK_SIZE; block_x * Z_BLOCK_SIZE < rect.x_max; block_x++)
+        {
+            z_block_max[(block_y * z_blocks_per_row) + block_x] = depth;
+        }
     }
 }
 
@@ -214,6 +396,8 @@ void destroy_window(void)
 
     free(color_buffer);
     free(z_buffer);
+    free(id_buffer);
+    free(z_block_max);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
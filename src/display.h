@@ -8,6 +8,10 @@
 #define FPS 60
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+// The depth buffer keeps the farthest depth of every block of Z_BLOCK_SIZE x Z_BLOCK_SIZE pixels,
+// a triangle that is farther than that everywhere cannot show anywhere in the block
+#define Z_BLOCK_SIZE 8
+
 enum RENDER_MODE_E
 {
     WireframeLine,
@@ -15,18 +19,33 @@ enum RENDER_MODE_E
     Filled,
     FilledWireframe,
     RenderTextured,
-    RenderTexturedWired
+    RenderTexturedWired,
+    RenderVisibilityBuffer // Textured, shaded once per pixel from a buffer of triangle ids
 
 };
 
+// Value of the pixels of the id buffer no triangle covers, triangle i is stored as i + 1
+#define NO_TRIANGLE_ID 0
+
+// Region of the screen a draw call is allowed to write to, the max corner is exclusive
+typedef struct
+{
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+} rect_t;
+
 bool initialize_window(void);
-void clear_color_buffer(uint32_t color);
-void clear_z_buffer(void);
+rect_t get_screen_rect(void);
+void clear_color_buffer(uint32_t color, rect_t rect);
+void clear_z_buffer(rect_t rect);
+void clear_id_buffer(rect_t rect);
 void render_color_buffer(void);
-void draw_grid(void);
-void draw_rect(int x, int y, int width, int height, uint32_t color);
+void draw_grid(rect_t rect);
+void draw_rect(int x, int y, int width, int height, uint32_t color, rect_t clip);
 void draw_pixel(int x, int y, uint32_t color);
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
+void draw_line(int x0, int y0, int x1, int y1, uint32_t color, rect_t clip);
 uint32_t light_apply_intensity(uint32_t original_color, float percentage_factor);
 int get_window_width(void);
 int get_window_height(void);
@@ -35,9 +54,16 @@ bool should_render_filled_triangle(void);
 bool should_render_textured_triangle(void);
 bool should_render_wireframe(void);
 bool should_render_dots(void);
+bool should_render_visibility_buffer(void);
 void destroy_window(void);
 
+uint32_t* get_color_buffer(void);
+float* get_z_buffer(void);
+uint32_t* get_id_buffer(void);
 float get_zbuffer_at(int x, int y);
+float* get_z_block_max(void);
+int get_z_blocks_per_row(void);
+void update_z_block_max(int block_x, int block_y);
 void update_zbuffer_at(int x, int y, float val);
 
 // extern SDL_Window* window;
@@ -0,0 +1,144 @@
+#include "jobs.h"
+#include <SDL2/SDL.h>
+#include <stdlib.h>
+
+static SDL_Thread** worker_threads = NULL;
+static int num_workers = 0;
+
+static SDL_mutex* jobs_mutex = NULL;
+static SDL_cond* work_posted = NULL;   // Signaled when a new batch is posted (or the pool shuts down)
+static SDL_cond* work_finished = NULL; // Signaled when the last worker is done with the batch
+
+// The current batch, only changed by run_jobs while every worker is waiting
+static job_function_t batch_function = NULL;
+static void* batch_data = NULL;
+static int batch_size = 0;
+static SDL_atomic_t next_job;
+
+static int batch_generation = 0;  // Incremented for every batch so the workers notice new work
+static int workers_finished = 0;  // Workers that ran out of jobs in the current batch
+static bool shutting_down = false;
+
+static bool multithreading = true;
+
+// Claims jobs of the current batch until there are none left
+static void execute_jobs(void) {
+    for (;;) {
+        int job_index = SDL_AtomicAdd(&next_job, 1);
+        if (job_index >= batch_size) {
+            break;
+        }
+        batch_function(job_index, batch_data);
+    }
+}
+
+static int worker_thread(void* data) {
+    int seen_generation = 0;
+
+    SDL_LockMutex(jobs_mutex);
+    for (;;) {
+        while (batch_generation == seen_generation && !shutting_down) {
+            SDL_CondWait(work_posted, jobs_mutex);
+        }
+        if (shutting_down) {
+            break;
+        }
+        seen_generation = batch_generation;
+        SDL_UnlockMutex(jobs_mutex);
+
+        execute_jobs();
+
+        // Every worker reports back, so none of them can still be looking at
+        // this batch when the next one is posted
+        SDL_LockMutex(jobs_mutex);
+        workers_finished++;
+        if (workers_finished == num_workers) {
+            SDL_CondSignal(work_finished);
+        }
+    }
+    SDL_UnlockMutex(jobs_mutex);
+    return 0;
+}
+
+// One worker per extra core, the main thread is the last one
+void init_jobs(void) {
+    jobs_mutex = SDL_CreateMutex();
+    work_posted = SDL_CreateCond();
+    work_finished = SDL_CreateCond();
+    SDL_AtomicSet(&next_job, 0);
+
+    int num_cpus = SDL_GetCPUCount();
+    num_workers = num_cpus > 1 ? num_cpus - 1 : 0;
+    worker_threads = (SDL_Thread**)malloc(sizeof(SDL_Thread*) * num_workers);
+    for (int i = 0; i < num_workers; i++) {
+        worker_threads[i] = SDL_CreateThread(worker_thread, "worker", NULL);
+        if (worker_threads[i] == NULL) {
+            // Keep the workers that did start, the main thread can run everything on its own
+            num_workers = i;
+            break;
+        }
+    }
+}
+
+void free_jobs(void) {
+    if (jobs_mutex == NULL) {
+        return;
+    }
+    SDL_LockMutex(jobs_mutex);
+    shutting_down = true;
+    SDL_CondBroadcast(work_posted);
+    SDL_UnlockMutex(jobs_mutex);
+
+    for (int i = 0; i < num_workers; i++) {
+        SDL_WaitThread(worker_threads[i], NULL);
+    }
+    free(worker_threads);
+    worker_threads = NULL;
+    num_workers = 0;
+
+    SDL_DestroyCond(work_posted);
+    SDL_DestroyCond(work_finished);
+    SDL_DestroyMutex(jobs_mutex);
+    jobs_mutex = NULL;
+}
+
+void run_jobs(job_function_t function, void* data, int num_jobs) {
+    // Not worth waking the workers for a single job
+    if (!multithreading || num_workers == 0 || num_jobs <= 1) {
+        for (int i = 0; i < num_jobs; i++) {
+            function(i, data);
+        }
+        return;
+    }
+
+    SDL_LockMutex(jobs_mutex);
+    batch_function = function;
+    batch_data = data;
+    batch_size = num_jobs;
+    SDL_AtomicSet(&next_job, 0);
+    workers_finished = 0;
+    batch_generation++;
+    SDL_CondBroadcast(work_posted);
+    SDL_UnlockMutex(jobs_mutex);
+
+    execute_jobs();
+
+    SDL_LockMutex(jobs_mutex);
+    while (workers_finished < num_workers) {
+        SDL_CondWait(work_finished, jobs_mutex);
+    }
+    SDL_UnlockMutex(jobs_mutex);
+}
+
+// Threads that work on a batch, including the main thread
+int get_num_job_threads(void) {
+    return multithreading ? num_workers + 1 : 1;
+}
+
+void set_multithreading(bool enabled) {
+    multithreading = enabled;
+}
+
+bool is_multithreading(void) {
+    return multithreading;
+}
@@ -0,0 +1,24 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////
+// Pool of worker threads that run a batch of independent jobs
+////////////////////////////////////////////////////////////////////////
+// run_jobs calls the function once for every index in [0, num_jobs) and
+// returns when all of them are done. The calling thread works on the batch
+// too. Jobs are handed out in order but finish in any order, so a job must
+// only write to memory that belongs to its own index.
+////////////////////////////////////////////////////////////////////////
+typedef void (*job_function_t)(int job_index, void* data);
+
+void init_jobs(void);
+void free_jobs(void);
+void run_jobs(job_function_t function, void* data, int num_jobs);
+int get_num_job_threads(void);
+
+void set_multithreading(bool enabled);
+bool is_multithreading(void);
+
+#endif
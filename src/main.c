@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include "display.h"
 #include "vector.h"
@@ -13,28 +16,134 @@
 #include "triangle.h"
 #include "upng.h"
 #include "clipping.h"
+#include "jobs.h"
+#include "tiles.h"
+#include "occlusion.h"
+#include "sort.h"
+#include "cpu.h"
 
 #define PI 3.14159265359
 
-#define MAX_TRIANGLES_PER_MESH 10000
-triangle_t triangles_to_render[MAX_TRIANGLES_PER_MESH];
+// Per frame arena of triangles: it grows geometrically and is only reset between frames, never freed
+triangle_t *triangles_to_render = NULL;
 float delta_time = 0;
 int num_triangles_to_render = 0;
+int max_triangles_to_render = 0; // High-water mark of the triangles in a frame
+
+// Order the triangles are drawn in, it can change every frame
+enum TRIANGLE_ORDER_E
+{
+    SubmissionOrder,
+    FrontToBackOrder, // Nearest first, so the depth test rejects the most pixels before they are shaded
+    TextureOrder      // Grouped by texture, then front to back inside every texture
+};
+
+enum TRIANGLE_ORDER_E triangle_order = SubmissionOrder;
+
+// Arenas of the triangle sort: keys, triangle indices and the sorted triangles, swapped with triangles_to_render
+uint64_t *sort_keys = NULL;
+int *sort_indices = NULL;
+uint64_t *sort_key_scratch = NULL;
+int *sort_index_scratch = NULL;
+triangle_t *sorted_triangles = NULL;
 
 mat4_t proj_matrix;
 mat4_t view_matrix;
 mat4_t world_matrix;
 
+////////////////////////////////////////////////////////////////////////
+// Geometry stage work for the worker threads
+////////////////////////////////////////////////////////////////////////
+// Every visible instance becomes a draw call. Its vertices are transformed
+// by vertex jobs into a slice of the per frame vertex arena, then its faces
+// are split in face jobs that each write triangles into their own arena.
+// The face job outputs are concatenated in job order, so the triangles come
+// out in the same order no matter how many threads did the work.
+////////////////////////////////////////////////////////////////////////
+#define VERTEX_JOB_SIZE 2048 // Multiple of VEC3_SOA_WIDTH so every job starts aligned
+#define FACE_JOB_SIZE 512
+
+typedef struct
+{
+    mesh_t *mesh;
+    int mesh_index;
+    int instance_index;
+    mesh_lod_t *lod;
+    mat4_t world_view_matrix;
+    mat4_t world_view_proj_matrix;
+    bool needs_clipping;
+    int first_vertex; // Start of the slice of the vertex arena used by this draw call
+} draw_call_t;
+
+// An instance that passed the frustum test, with the level of detail it is drawn at
+typedef struct
+{
+    int instance_index;
+    mesh_instance_t *instance;
+    mesh_t *mesh;
+    int lod;
+    int frustum_visibility;
+    mat4_t world_view_matrix;
+    mat4_t world_view_proj_matrix;
+} instance_view_t;
+
+typedef struct
+{
+    int draw_call;
+    int first; // First vertex or face of the job
+    int count;
+} geometry_job_t;
+
+instance_view_t *instance_views = NULL;
+draw_call_t *draw_calls = NULL;
+geometry_job_t *vertex_jobs = NULL;
+geometry_job_t *face_jobs = NULL;
+
+// Per frame vertex arena shared by all the draw calls
+vec4_t *frame_transformed_vertices = NULL;
+vec4_t *frame_clip_vertices = NULL;
+uint16_t *frame_outcodes = NULL;
+
+// Triangle arena of every face job, kept between frames
+triangle_t **face_job_triangles = NULL;
+int num_face_job_arenas = 0;
+
 bool is_running = false;
 int previous_frame_time = 0;
 
 bool should_cull = true;
+bool should_use_lods = true;
+bool should_use_z_prepass = false; // Depth of every triangle first, then only the nearest surface is shaded
+bool should_rotate_instances = false; // Spin every instance around its y axis, the scene hierarchy is refit every frame
+
+// Mesh instances that passed frustum culling this frame
+bvh_visible_t *visible_instances = NULL;
+
+// Groups the instances of the same mesh together, then keeps them in the order they were added
+int compare_visible_instances(const void *a, const void *b)
+{
+    int index_a = ((const bvh_visible_t *)a)->object_index;
+    int index_b = ((const bvh_visible_t *)b)->object_index;
+    int mesh_a = get_mesh_instance(index_a)->mesh_index;
+    int mesh_b = get_mesh_instance(index_b)->mesh_index;
+    if (mesh_a != mesh_b)
+    {
+        return mesh_a - mesh_b;
+    }
+    return index_a - index_b;
+}
+
 void setup(void)
 {
     // Allocate the required memory in bytes to hold the color buffer
 
     set_render_method(RenderTextured);
 
+    // Start the worker threads of the geometry stage and the rasterizer
+    init_jobs();
+    init_tiles(get_window_width(), get_window_height());
+    init_occlusion(get_window_width(), get_window_height());
+
     init_light(vec3_new(0, 0, 1));
     // Initialize the perspective projection matrix
     float aspecty = (float)get_window_height() / get_window_width();
@@ -52,8 +161,10 @@ void setup(void)
 
     // Manually load the hardcoded texture data from the static array
     // mesh_texture = (uint32_t*) REDBRICK_TEXTURE;
-    load_mesh("./assets/f22.obj", "./assets/f22.png", vec3_new(1, 1, 1), vec3_new(+3, 0, 8), vec3_new(0, 0, 0));
-    load_mesh("./assets/cube.obj", "./assets/cube.png", vec3_new(1, 1, 1), vec3_new(-3, 0, 8), vec3_new(0, 0, 0));
+    // The plane is kept in BC1 blocks, its texture has no alpha and loses little to them
+    load_mesh("./assets/f22.obj", "./assets/f22.png", TEXTURE_FORMAT_BC1, vec3_new(1, 1, 1), vec3_new(+3, 0, 8), vec3_new(0, 0, 0));
+    int cube = load_mesh("./assets/cube.obj", "./assets/cube.png", TEXTURE_FORMAT_RGBA8, vec3_new(1, 1, 1), vec3_new(-3, 0, 8), vec3_new(0, 0, 0));
+    set_mesh_instance_occluder(cube, true);
 }
 
 void process_input(void)
@@ -103,6 +214,12 @@ void process_input(void)
                 set_render_method(RenderTexturedWired);
                 break;
             }
+            if (event.key.keysym.sym == SDLK_7)
+            {
+
+                set_render_method(RenderVisibilityBuffer);
+                break;
+            }
             if (event.key.keysym.sym == SDLK_c)
             {
 
@@ -115,6 +232,54 @@ void process_input(void)
                 should_cull = false;
                 break;
             }
+            if (event.key.keysym.sym == SDLK_l)
+            {
+
+                should_use_lods = !should_use_lods;
+                break;
+            }
+            if (event.key.keysym.sym == SDLK_g)
+            {
+
+                set_guard_band_clipping(!is_guard_band_clipping());
+                break;
+            }
+            if (event.key.keysym.sym == SDLK_m)
+            {
+
+                set_multithreading(!is_multithreading());
+                break;
+            }
+            if (event.key.keysym.sym == SDLK_o)
+            {
+
+                set_occlusion_culling(!is_occlusion_culling());
+                break;
+            }
+            if (event.key.keysym.sym == SDLK_r)
+            {
+
+                should_rotate_instances = !should_rotate_instances;
+                break;
+            }
+            if (event.key.keysym.sym == SDLK_z)
+            {
+
+                should_use_z_prepass = !should_use_z_prepass;
+                break;
+            }
+            if (event.key.keysym.sym == SDLK_k)
+            {
+
+                triangle_order = (triangle_order + 1) % (TextureOrder + 1);
+                break;
+            }
+            if (event.key.keysym.sym == SDLK_t)
+            {
+
+                set_texture_filter((get_texture_filter() + 1) % (TEXTURE_FILTER_TRILINEAR + 1));
+                break;
+            }
             if (event.key.keysym.sym == SDLK_ESCAPE)
             {
                 is_running = false;
@@ -157,55 +322,176 @@ void process_input(void)
     }
 }
 
-// model space -> world space -> camera space -> clipping -> projection -> image space -> screen space
-void process_graphics_pipeline_stages(mesh_t *mesh)
+// model space -> world space -> camera space: culls the instance against the frustum and picks its level of detail
+void view_instance(int instance_index, bool fully_inside)
 {
-    // Create a scale, translation and rotation matrix that will be used to multiply the mesh vertices;
-    mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-    mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
-    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+    mesh_instance_t *instance = get_mesh_instance(instance_index);
+    mesh_t *mesh = get_mesh(instance->mesh_index);
+    world_matrix = get_mesh_instance_world_matrix(instance);
 
-    vec3_t target = get_camera_lookat_target();
-    vec3_t up_direction = vec3_new(0, 1, 0);
-    // Create the view matrix to transform the objects into camera space looking at a hard coded target point
-    view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
+    // Combine world and view so each vertex goes from model space to camera space with a single multiplication
+    mat4_t world_view_matrix = mat4_mul_mat4(view_matrix, world_matrix);
+
+    // Bounding sphere of the mesh in camera space
+    float max_scale = fmax(fabs(instance->scale.x), fmax(fabs(instance->scale.y), fabs(instance->scale.z)));
+    sphere_t view_sphere = sphere_transform(mesh->bounding_sphere, world_view_matrix, max_scale);
 
-    // all triangle faces of our mesh
-    int num_faces = array_length(mesh->faces);
-    for (int i = 0; i < num_faces; i++)
+    // Test the bounding volumes of the whole mesh against the frustum: the sphere is cheap and the box is tighter
+    // The scene hierarchy already tells when the mesh is fully inside
+    int mesh_visibility = FRUSTUM_INSIDE;
+    if (!fully_inside)
     {
-        face_t mesh_face = mesh->faces[i];
+        mesh_visibility = frustum_test_sphere(view_sphere);
+        if (mesh_visibility == FRUSTUM_INTERSECTING)
+        {
+            mesh_visibility = frustum_test_aabb(mesh->bounding_box, world_view_matrix);
+        }
+    }
+    // Skip every face of a mesh that is completely out of view
+    if (mesh_visibility == FRUSTUM_OUTSIDE)
+    {
+        return;
+    }
 
-        vec3_t face_vertices[3];
-        face_vertices[0] = mesh->vertices[mesh_face.a];
-        face_vertices[1] = mesh->vertices[mesh_face.b];
-        face_vertices[2] = mesh->vertices[mesh_face.c];
+    // Pick the level of detail from the size of the bounding sphere on screen (full detail when the camera is inside it)
+    int lod = 0;
+    if (should_use_lods && view_sphere.center.z > view_sphere.radius)
+    {
+        float screen_radius = view_sphere.radius * proj_matrix.m[1][1] / view_sphere.center.z * (get_window_height() / 2.0);
+        lod = select_mesh_lod(mesh, screen_radius);
+    }
 
-        vec4_t transformed_vertices[3];
+    instance_view_t view = {
+        .instance_index = instance_index,
+        .instance = instance,
+        .mesh = mesh,
+        .lod = lod,
+        .frustum_visibility = mesh_visibility,
+        .world_view_matrix = world_view_matrix,
+        .world_view_proj_matrix = mat4_mul_mat4(proj_matrix, world_view_matrix)};
+    array_push(instance_views, view);
+}
 
-        // Loop all three vertices of this current face and apply transformations
-        for (int j = 0; j < 3; j++)
-        {
-            vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
+// Records the work to transform and draw a visible instance
+void prepare_draw_call(instance_view_t *view)
+{
+    draw_call_t draw_call = {
+        .mesh = view->mesh,
+        .mesh_index = view->instance->mesh_index,
+        .instance_index = view->instance_index,
+        .lod = &view->mesh->lods[view->lod],
+        .world_view_matrix = view->world_view_matrix,
+        .world_view_proj_matrix = view->world_view_proj_matrix,
+        // A mesh completely inside the frustum does not need any of its faces clipped
+        .needs_clipping = view->frustum_visibility != FRUSTUM_INSIDE,
+        .first_vertex = array_length(frame_transformed_vertices)};
+    int draw_call_index = array_length(draw_calls);
+    array_push(draw_calls, draw_call);
+
+    // Reserve the vertices of the level of detail in the arena, rounded up for the SIMD transform
+    int num_vertices = draw_call.lod->num_vertices;
+    int num_reserved = (num_vertices + VEC3_SOA_WIDTH - 1) / VEC3_SOA_WIDTH * VEC3_SOA_WIDTH;
+    frame_transformed_vertices = array_hold(frame_transformed_vertices, num_reserved, sizeof(vec4_t));
+    frame_clip_vertices = array_hold(frame_clip_vertices, num_reserved, sizeof(vec4_t));
+    frame_outcodes = array_hold(frame_outcodes, num_reserved, sizeof(uint16_t));
+
+    // Transform every vertex of the mesh once, shared vertices are not transformed again for every face
+    for (int first = 0; first < num_vertices; first += VERTEX_JOB_SIZE)
+    {
+        int count = num_vertices - first < VERTEX_JOB_SIZE ? num_vertices - first : VERTEX_JOB_SIZE;
+        geometry_job_t job = {draw_call_index, first, count};
+        array_push(vertex_jobs, job);
+    }
+
+    // all triangle faces of the selected level of detail
+    int num_faces = array_length(draw_call.lod->faces);
+    for (int first = 0; first < num_faces; first += FACE_JOB_SIZE)
+    {
+        int count = num_faces - first < FACE_JOB_SIZE ? num_faces - first : FACE_JOB_SIZE;
+        geometry_job_t job = {draw_call_index, first, count};
+        array_push(face_jobs, job);
+    }
+}
 
-            world_matrix = mat4_identity();
-            // Multiply all matrices and load the world matrix [T]*[R]*[S]*v
-            world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-            world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+void transform_vertices_job(int job_index, void *data)
+{
+    geometry_job_t job = vertex_jobs[job_index];
+    draw_call_t *draw_call = &draw_calls[job.draw_call];
+
+    transform_mesh_vertices(
+        draw_call->mesh,
+        draw_call->world_view_matrix,
+        draw_call->world_view_proj_matrix,
+        job.first,
+        job.count,
+        &frame_transformed_vertices[draw_call->first_vertex],
+        &frame_clip_vertices[draw_call->first_vertex],
+        draw_call->needs_clipping ? &frame_outcodes[draw_call->first_vertex] : NULL);
+}
 
-            transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
+// Key of a triangle for the draw order of this frame, the nearest vertex is the depth of the triangle.
+// Meshes can share a texture, so the id of the texture groups them and the instance breaks the ties.
+// Triangles without a texture come last.
+uint64_t make_triangle_sort_key(triangle_t *triangle, int instance_index)
+{
+    // w is positive after clipping, and the bits of positive floats sort like the floats do
+    float nearest_w = fmin(triangle->points[0].w, fmin(triangle->points[1].w, triangle->points[2].w));
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &nearest_w, sizeof(depth_bits));
+
+    uint64_t texture_id = triangle->texture != NULL ? (uint64_t)(triangle->texture->id & 0xFFFF) : 0xFFFF;
+    uint64_t instance_id = (uint64_t)(instance_index & 0xFFFF);
+    switch (triangle_order)
+    {
+    case FrontToBackOrder:
+        return ((uint64_t)depth_bits << 32) | (texture_id << 16) | instance_id;
+    case TextureOrder:
+        return (texture_id << 48) | ((uint64_t)depth_bits << 16) | instance_id;
+    default:
+        return 0;
+    }
+}
+
+// camera space -> clipping -> projection -> image space -> screen space for a range of faces of a draw call
+void process_faces_job(int job_index, void *data)
+{
+    geometry_job_t job = face_jobs[job_index];
+    draw_call_t *draw_call = &draw_calls[job.draw_call];
+    mesh_t *mesh = draw_call->mesh;
+    bool needs_clipping = draw_call->needs_clipping;
 
-            // Multiply the view matrix with the object vertices to transform everything into camera space
-            transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
+    // The slices of the vertex arena filled by the vertex jobs of this draw call
+    vec4_t *mesh_transformed_vertices = &frame_transformed_vertices[draw_call->first_vertex];
+    vec4_t *mesh_clip_vertices = &frame_clip_vertices[draw_call->first_vertex];
+    uint16_t *mesh_outcodes = &frame_outcodes[draw_call->first_vertex];
 
-            // Save transformed vertex in the array of transformed vertices
-            transformed_vertices[j] = transformed_vertex;
+    triangle_t *job_triangles = array_reset(face_job_triangles[job_index]);
+
+    for (int i = job.first; i < job.first + job.count; i++)
+    {
+        face_t mesh_face = draw_call->lod->faces[i];
+
+        // Reject the face when all of its vertices are outside the same frustum plane
+        uint16_t outcode_a = 0;
+        uint16_t outcode_b = 0;
+        uint16_t outcode_c = 0;
+        if (needs_clipping)
+        {
+            outcode_a = mesh_outcodes[mesh_face.a];
+            outcode_b = mesh_outcodes[mesh_face.b];
+            outcode_c = mesh_outcodes[mesh_face.c];
+            if (outcode_a & outcode_b & outcode_c & OUTCODE_FRUSTUM_MASK)
+            {
+                continue;
+            }
         }
+
+        // Look up the camera space vertices of this face
+        vec4_t transformed_vertices[3];
+        transformed_vertices[0] = mesh_transformed_vertices[mesh_face.a];
+        transformed_vertices[1] = mesh_transformed_vertices[mesh_face.b];
+        transformed_vertices[2] = mesh_transformed_vertices[mesh_face.c];
+
         // Calculate the triangle face normal
         vec3_t face_normal = get_triangle_normal(transformed_vertices);
 
@@ -223,21 +509,39 @@ void process_graphics_pipeline_stages(mesh_t *mesh)
                 continue;
             }
         }
-        // Create  a polygon from the original transform create_polygon
-        polygon_t polygon = create_polygon_from_triangle(
-            vec3_from_vec4(transformed_vertices[0]),
-            vec3_from_vec4(transformed_vertices[1]),
-            vec3_from_vec4(transformed_vertices[2]),
-            mesh_face.a_uv,
-            mesh_face.b_uv,
-            mesh_face.c_uv);
-
-        // Clip the polygon and return a new polygon with potential new vertices
-        clip_polygon(&polygon);
 
         triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
         int num_triangles_after_clipping = 0;
-        triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+
+        // The planes the face has to be clipped against, if none the triangle skips the clipper
+        // (with the guard band a triangle crossing the screen edges is left to the rasterizer scissor)
+        uint16_t clip_mask = get_clip_mask(outcode_a | outcode_b | outcode_c);
+        if (clip_mask == 0)
+        {
+            triangles_after_clipping[0].points[0] = mesh_clip_vertices[mesh_face.a];
+            triangles_after_clipping[0].points[1] = mesh_clip_vertices[mesh_face.b];
+            triangles_after_clipping[0].points[2] = mesh_clip_vertices[mesh_face.c];
+            triangles_after_clipping[0].texcoords[0] = mesh_face.a_uv;
+            triangles_after_clipping[0].texcoords[1] = mesh_face.b_uv;
+            triangles_after_clipping[0].texcoords[2] = mesh_face.c_uv;
+            num_triangles_after_clipping = 1;
+        }
+        else
+        {
+            // Create  a polygon from the clip space vertices of the face
+            polygon_t polygon = create_polygon_from_triangle(
+                mesh_clip_vertices[mesh_face.a],
+                mesh_clip_vertices[mesh_face.b],
+                mesh_clip_vertices[mesh_face.c],
+                mesh_face.a_uv,
+                mesh_face.b_uv,
+                mesh_face.c_uv);
+
+            // Clip the polygon against the planes it crosses and return a new polygon with potential new vertices
+            clip_polygon(&polygon, clip_mask);
+
+            triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+        }
 
         for (int t = 0; t < num_triangles_after_clipping; t++)
         {
@@ -248,7 +552,15 @@ void process_graphics_pipeline_stages(mesh_t *mesh)
             // Loop all three vertices to perform projection
             for (int j = 0; j < 3; j++)
             {
-                projected_points[j] = mat4_mul_vec4_project(proj_matrix, triangle_after_clipping.points[j]);
+                projected_points[j] = triangle_after_clipping.points[j];
+
+                // do the perspective divide with the original Z value stored in W
+                if (projected_points[j].w != 0.0)
+                {
+                    projected_points[j].x /= projected_points[j].w;
+                    projected_points[j].y /= projected_points[j].w;
+                    projected_points[j].z /= projected_points[j].w;
+                }
 
                 // scale into the view
                 projected_points[j].x *= (get_window_width() / 2.0);
@@ -278,15 +590,40 @@ void process_graphics_pipeline_stages(mesh_t *mesh)
                     {triangle_after_clipping.texcoords[2].u, triangle_after_clipping.texcoords[2].v},
                 },
                 .texture = mesh->texture};
+            triangle_to_render.sort_key = make_triangle_sort_key(&triangle_to_render, draw_call->instance_index);
 
-            // Save the projected triangle in the array of triangles to render
-            // triangles_to_render[i] = projected_triangle;
-            if (num_triangles_to_render < MAX_TRIANGLES_PER_MESH)
-            {
-                triangles_to_render[num_triangles_to_render++] = triangle_to_render;
-            }
+            // Save the projected triangle in the output of this job
+            array_push(job_triangles, triangle_to_render);
         }
     }
+
+    face_job_triangles[job_index] = job_triangles;
+}
+
+// Reorders the triangles of the frame by their sort keys, triangles with the same key keep their order
+void sort_triangles(void)
+{
+    int count = num_triangles_to_render;
+    sort_keys = array_hold(array_reset(sort_keys), count, sizeof(uint64_t));
+    sort_indices = array_hold(array_reset(sort_indices), count, sizeof(int));
+    sort_key_scratch = array_hold(array_reset(sort_key_scratch), count, sizeof(uint64_t));
+    sort_index_scratch = array_hold(array_reset(sort_index_scratch), count, sizeof(int));
+    for (int i = 0; i < count; i++)
+    {
+        sort_keys[i] = triangles_to_render[i].sort_key;
+        sort_indices[i] = i;
+    }
+
+    radix_sort(sort_keys, sort_indices, count, sort_key_scratch, sort_index_scratch);
+
+    sorted_triangles = array_hold(array_reset(sorted_triangles), count, sizeof(triangle_t));
+    for (int i = 0; i < count; i++)
+    {
+        sorted_triangles[i] = triangles_to_render[sort_indices[i]];
+    }
+    triangle_t *unsorted_triangles = triangles_to_render;
+    triangles_to_render = sorted_triangles;
+    sorted_triangles = unsorted_triangles;
 }
 
 void update(void)
@@ -303,35 +640,186 @@ void update(void)
 
     previous_frame_time = SDL_GetTicks();
 
-    // Initialize the counter of triangles to render for the current frame;
+    // Initialize the counter of triangles to render for the current frame, keeping the memory of the last frames
+    triangles_to_render = array_reset(triangles_to_render);
     num_triangles_to_render = 0;
 
-    // mesh.rotation.x += 0.00 * delta_time;
-    // mesh.rotation.y += 0.200 * delta_time;
-    // mesh.rotation.z += 0.00 * delta_time;
+    // Instances are moved through set_mesh_instance_transform so their boxes in the scene hierarchy follow them
+    if (should_rotate_instances)
+    {
+        for (int i = 0; i < get_num_mesh_instances(); i++)
+        {
+            mesh_instance_t *instance = get_mesh_instance(i);
+            vec3_t rotation = instance->rotation;
+            rotation.y += 0.200 * delta_time;
+            set_mesh_instance_transform(i, instance->scale, instance->translation, rotation);
+        }
+    }
     // mesh.translation.z = 5.0;
 
     // mesh.translation.x += 0.01;
 
-    for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++)
+    vec3_t target = get_camera_lookat_target();
+    vec3_t up_direction = vec3_new(0, 1, 0);
+    // Create the view matrix to transform the objects into camera space looking at a hard coded target point
+    view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
+    update_world_frustum_planes(view_matrix);
+
+    // Walk the scene hierarchy to find the mesh instances that can be seen this frame
+    update_mesh_instance_bvh();
+    visible_instances = (bvh_visible_t *)realloc(visible_instances, sizeof(bvh_visible_t) * get_num_mesh_instances());
+    int num_visible_instances = 0;
+    cull_mesh_instances(visible_instances, &num_visible_instances);
+
+    // Submit all the instances of a mesh back to back so its geometry stays hot in the cache,
+    // the order is always the same so the triangles are submitted in the same order every frame
+    qsort(visible_instances, num_visible_instances, sizeof(bvh_visible_t), compare_visible_instances);
+
+    draw_calls = array_reset(draw_calls);
+    vertex_jobs = array_reset(vertex_jobs);
+    face_jobs = array_reset(face_jobs);
+    frame_transformed_vertices = array_reset(frame_transformed_vertices);
+    frame_clip_vertices = array_reset(frame_clip_vertices);
+    frame_outcodes = array_reset(frame_outcodes);
+
+    instance_views = array_reset(instance_views);
+    for (int i = 0; i < num_visible_instances; i++)
+    {
+        view_instance(visible_instances[i].object_index, visible_instances[i].fully_inside);
+    }
+
+    // Draw the occluders into the occlusion buffer, at the level of detail they are drawn at on screen.
+    // Lines and dots are drawn without a depth test, they show what is behind the occluders: only a frame
+    // where every pixel is depth tested can skip hidden instances, otherwise the buffer stays empty.
+    int num_views = array_length(instance_views);
+    bool is_depth_tested_frame = (should_render_filled_triangle() || should_render_textured_triangle() || should_render_visibility_buffer()) &&
+                                 !should_render_wireframe() && !should_render_dots();
+    clear_occlusion_buffer();
+    if (is_occlusion_culling() && is_depth_tested_frame)
+    {
+        for (int i = 0; i < num_views; i++)
+        {
+            instance_view_t *view = &instance_views[i];
+            if (view->instance->is_occluder)
+            {
+                draw_occluder(view->mesh, &view->mesh->lods[view->lod], view->world_view_matrix, view->world_view_proj_matrix, should_cull);
+            }
+        }
+    }
+
+    // Skip the instances hidden behind the occluders before any of their vertices are transformed
+    for (int i = 0; i < num_views; i++)
+    {
+        instance_view_t *view = &instance_views[i];
+        if (!view->instance->is_occluder && is_box_occluded(view->mesh->bounding_box, view->world_view_proj_matrix))
+        {
+            continue;
+        }
+        prepare_draw_call(view);
+    }
+
+    // Every face job needs its own triangle arena
+    int num_face_jobs = array_length(face_jobs);
+    if (num_face_jobs > num_face_job_arenas)
+    {
+        face_job_triangles = (triangle_t **)realloc(face_job_triangles, sizeof(triangle_t *) * num_face_jobs);
+        for (int i = num_face_job_arenas; i < num_face_jobs; i++)
+        {
+            face_job_triangles[i] = NULL;
+        }
+        num_face_job_arenas = num_face_jobs;
+    }
+
+    // All the vertices have to be transformed before any face can look them up
+    run_jobs(transform_vertices_job, NULL, array_length(vertex_jobs));
+    run_jobs(process_faces_job, NULL, num_face_jobs);
+
+    // Gather the triangles of the face jobs in order
+    for (int i = 0; i < num_face_jobs; i++)
     {
-        mesh_t *mesh = get_mesh(mesh_index);
-        process_graphics_pipeline_stages(mesh);
+        int num_job_triangles = array_length(face_job_triangles[i]);
+        if (num_job_triangles == 0)
+        {
+            continue;
+        }
+        triangles_to_render = array_hold(triangles_to_render, num_job_triangles, sizeof(triangle_t));
+        memcpy(&triangles_to_render[num_triangles_to_render], face_job_triangles[i], sizeof(triangle_t) * num_job_triangles);
+        num_triangles_to_render += num_job_triangles;
+    }
+
+    if (triangle_order != SubmissionOrder)
+    {
+        sort_triangles();
+    }
+
+    if (num_triangles_to_render > max_triangles_to_render)
+    {
+        max_triangles_to_render = num_triangles_to_render;
     }
 }
 
-void render(void)
+// The pre-pass does the depth test of the whole tile before anything is shaded
+bool is_z_prepass_active(void)
 {
-    clear_color_buffer(0xFF000000);
-    clear_z_buffer();
-    draw_grid();
+    return should_use_z_prepass && (should_render_filled_triangle() || should_render_textured_triangle());
+}
 
-    // draw_filled_triangle(300,100, 50, 400, 500, 700, 0xFFFF00FF);
+// Fills the depth of a tile with every triangle binned to it, with no color work at all
+void depth_prepass_tile_job(int tile_index, void *data)
+{
+    rect_t tile_rect = get_tile_rect(tile_index);
+    clear_z_buffer(tile_rect);
 
-    // Loop all projected triangles and render them
-    for (int i = 0; i < num_triangles_to_render; i++)
+    int *tile_triangles = get_tile_triangles(tile_index);
+    int num_tile_triangles = get_num_tile_triangles(tile_index);
+    for (int i = 0; i < num_tile_triangles; i++)
     {
-        triangle_t triangle = triangles_to_render[i];
+        triangle_t *triangle = &triangles_to_render[tile_triangles[i]];
+        draw_triangle_depth(
+            triangle->points[0].x, triangle->points[0].y, triangle->points[0].z, triangle->points[0].w,
+            triangle->points[1].x, triangle->points[1].y, triangle->points[1].z, triangle->points[1].w,
+            triangle->points[2].x, triangle->points[2].y, triangle->points[2].z, triangle->points[2].w,
+            tile_rect);
+    }
+}
+
+// Draws every triangle binned to a tile, only touching the pixels of that tile
+void render_tile_job(int tile_index, void *data)
+{
+    rect_t tile_rect = get_tile_rect(tile_index);
+
+    clear_color_buffer(0xFF000000, tile_rect);
+    // Keep the depth of the pre-pass, the triangles are then only drawn where they are the nearest
+    if (!is_z_prepass_active())
+    {
+        clear_z_buffer(tile_rect);
+    }
+    draw_grid(tile_rect);
+
+    int *tile_triangles = get_tile_triangles(tile_index);
+    int num_tile_triangles = get_num_tile_triangles(tile_index);
+
+    // Visibility buffer: the raster pass only keeps the nearest triangle of every pixel, then each pixel is textured once
+    if (should_render_visibility_buffer())
+    {
+        clear_id_buffer(tile_rect);
+        for (int i = 0; i < num_tile_triangles; i++)
+        {
+            triangle_t *triangle = &triangles_to_render[tile_triangles[i]];
+            draw_triangle_id(
+                triangle->points[0].x, triangle->points[0].y, triangle->points[0].z, triangle->points[0].w,
+                triangle->points[1].x, triangle->points[1].y, triangle->points[1].z, triangle->points[1].w,
+                triangle->points[2].x, triangle->points[2].y, triangle->points[2].z, triangle->points[2].w,
+                tile_triangles[i] + 1, tile_rect);
+        }
+        shade_visibility_buffer(triangles_to_render, tile_rect);
+        return;
+    }
+
+    // Loop all projected triangles of the tile and render them, in the order they were submitted
+    for (int i = 0; i < num_tile_triangles; i++)
+    {
+        triangle_t triangle = triangles_to_render[tile_triangles[i]];
 
         // Draw filled triangle
         if (should_render_filled_triangle())
@@ -340,7 +828,7 @@ void render(void)
                 triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w,
                 triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w,
                 triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w,
-                triangle.color);
+                triangle.color, tile_rect);
         }
         // Draw textured triangle
         if (should_render_textured_triangle())
@@ -349,7 +837,7 @@ void render(void)
                 triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, triangle.texcoords[0].u, triangle.texcoords[0].v,
                 triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, triangle.texcoords[1].u, triangle.texcoords[1].v,
                 triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, triangle.texcoords[2].u, triangle.texcoords[2].v,
-                triangle.texture);
+                triangle.texture, tile_rect);
         }
         // Draw wireframe
         if (should_render_wireframe())
@@ -358,24 +846,60 @@ void render(void)
                 triangle.points[0].x, triangle.points[0].y,
                 triangle.points[1].x, triangle.points[1].y,
                 triangle.points[2].x, triangle.points[2].y,
-                0xFFFFFF00);
+                0xFFFFFF00, tile_rect);
         }
 
         // Draw dots
         if (should_render_dots())
         {
             // Draw Vertex Points
-            draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, 6, 6, 0xFFFF0000);
-            draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, 6, 6, 0xFFFF0000);
-            draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, 6, 6, 0xFFFF0000);
+            draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, 6, 6, 0xFFFF0000, tile_rect);
+            draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, 6, 6, 0xFFFF0000, tile_rect);
+            draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, 6, 6, 0xFFFF0000, tile_rect);
         }
     }
+}
+
+void render(void)
+{
+    // Sort the triangles into screen tiles, then let the worker threads draw whole tiles
+    bin_triangles(triangles_to_render, num_triangles_to_render);
+    if (is_z_prepass_active())
+    {
+        run_jobs(depth_prepass_tile_job, NULL, get_num_tiles());
+        set_depth_test(DEPTH_TEST_EQUAL);
+    }
+    run_jobs(render_tile_job, NULL, get_num_tiles());
+    set_depth_test(DEPTH_TEST_LESS);
 
     render_color_buffer();
 }
 void free_resources(void)
 {
+    printf("Triangles per frame high-water mark: %d (arena capacity %d)\n", max_triangles_to_render, array_capacity(triangles_to_render));
     free_meshes();
+    free(visible_instances);
+    array_free(triangles_to_render);
+    array_free(sorted_triangles);
+    array_free(sort_keys);
+    array_free(sort_indices);
+    array_free(sort_key_scratch);
+    array_free(sort_index_scratch);
+    for (int i = 0; i < num_face_job_arenas; i++)
+    {
+        array_free(face_job_triangles[i]);
+    }
+    free(face_job_triangles);
+    array_free(instance_views);
+    array_free(draw_calls);
+    array_free(vertex_jobs);
+    array_free(face_jobs);
+    array_free(frame_transformed_vertices);
+    array_free(frame_clip_vertices);
+    array_free(frame_outcodes);
+    free_tiles();
+    free_occlusion();
+    free_jobs();
     destroy_window();
 }
 
@@ -384,6 +908,10 @@ void free_resources(void)
 ////////////////////////////////////////////////////////////////////////
 int main(int argc, char *argv[])
 {
+    // Pick the SIMD kernels before anything uses them (texture decoding already does)
+    init_cpu_dispatch();
+    printf("CPU path: %s\n", get_cpu_path_name(get_cpu_path()));
+
     is_running = initialize_window();
 
     setup();
@@ -1,5 +1,10 @@
 #include "matrix.h"
 #include "math.h"
+#include "cpu.h"
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#endif
 
 mat4_t mat4_identity(void){
     // | 1 0 0 0 |               
@@ -142,4 +147,113 @@ mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up) {
     }};
 
     return view_matrix;
-}
\ No newline at end of file
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Batch transform of SoA positions (with an implicit w = 1) by a matrix
+///////////////////////////////////////////////////////////////////////////////
+// Every lane computes exactly what mat4_mul_vec4 does, in the same order of
+// operations, so the SIMD paths give the same results as the scalar one.
+// Only the first count positions are needed, but they are processed in whole
+// batches: out must have room for count rounded up to VEC3_SOA_WIDTH, which
+// is never more than positions->padded_count. The kernel is picked at runtime
+// from the active CPU path.
+///////////////////////////////////////////////////////////////////////////////
+static void mat4_mul_vec3_soa_scalar(const mat4_t *m, const vec3_soa_t *positions, int count, vec4_t *out)
+{
+    for (int i = 0; i < count; i++)
+    {
+        vec4_t v = {positions->x[i], positions->y[i], positions->z[i], 1.0};
+        out[i] = mat4_mul_vec4(*m, v);
+    }
+}
+
+#if defined(CPU_X86)
+// 8 positions per iteration
+CPU_TARGET("avx2")
+static void mat4_mul_vec3_soa_avx2(const mat4_t *m, const vec3_soa_t *positions, int count, vec4_t *out)
+{
+    __m256 row[4][4];
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            row[i][j] = _mm256_set1_ps(m->m[i][j]);
+
+    for (int i = 0; i < count; i += 8)
+    {
+        __m256 x = _mm256_load_ps(&positions->x[i]);
+        __m256 y = _mm256_load_ps(&positions->y[i]);
+        __m256 z = _mm256_load_ps(&positions->z[i]);
+        __m256 r[4];
+        for (int k = 0; k < 4; k++)
+        {
+            r[k] = _mm256_mul_ps(row[k][0], x);
+            r[k] = _mm256_add_ps(r[k], _mm256_mul_ps(row[k][1], y));
+            r[k] = _mm256_add_ps(r[k], _mm256_mul_ps(row[k][2], z));
+            r[k] = _mm256_add_ps(r[k], row[k][3]);
+        }
+        // Transpose the x,y,z,w registers back into 8 consecutive vec4_t
+        __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+        __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+        __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+        __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+        __m256 v0 = _mm256_shuffle_ps(t0, t2, 0x44);
+        __m256 v1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+        __m256 v2 = _mm256_shuffle_ps(t1, t3, 0x44);
+        __m256 v3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+        float *dst = (float *)&out[i];
+        _mm256_storeu_ps(dst + 0, _mm256_permute2f128_ps(v0, v1, 0x20));
+        _mm256_storeu_ps(dst + 8, _mm256_permute2f128_ps(v2, v3, 0x20));
+        _mm256_storeu_ps(dst + 16, _mm256_permute2f128_ps(v0, v1, 0x31));
+        _mm256_storeu_ps(dst + 24, _mm256_permute2f128_ps(v2, v3, 0x31));
+    }
+}
+
+// 4 positions per iteration
+CPU_TARGET("sse2")
+static void mat4_mul_vec3_soa_sse2(const mat4_t *m, const vec3_soa_t *positions, int count, vec4_t *out)
+{
+    __m128 row[4][4];
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            row[i][j] = _mm_set1_ps(m->m[i][j]);
+
+    for (int i = 0; i < count; i += 4)
+    {
+        __m128 x = _mm_load_ps(&positions->x[i]);
+        __m128 y = _mm_load_ps(&positions->y[i]);
+        __m128 z = _mm_load_ps(&positions->z[i]);
+        __m128 r[4];
+        for (int k = 0; k < 4; k++)
+        {
+            r[k] = _mm_mul_ps(row[k][0], x);
+            r[k] = _mm_add_ps(r[k], _mm_mul_ps(row[k][1], y));
+            r[k] = _mm_add_ps(r[k], _mm_mul_ps(row[k][2], z));
+            r[k] = _mm_add_ps(r[k], row[k][3]);
+        }
+        // Transpose the x,y,z,w registers back into 4 consecutive vec4_t
+        _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+        float *dst = (float *)&out[i];
+        _mm_storeu_ps(dst + 0, r[0]);
+        _mm_storeu_ps(dst + 4, r[1]);
+        _mm_storeu_ps(dst + 8, r[2]);
+        _mm_storeu_ps(dst + 12, r[3]);
+    }
+}
+#endif
+
+void mat4_mul_vec3_soa(const mat4_t *m, const vec3_soa_t *positions, int count, vec4_t *out)
+{
+#if defined(CPU_X86)
+    if (get_cpu_path() >= CPU_PATH_AVX2)
+    {
+        mat4_mul_vec3_soa_avx2(m, positions, count, out);
+        return;
+    }
+    if (get_cpu_path() >= CPU_PATH_SSE2)
+    {
+        mat4_mul_vec3_soa_sse2(m, positions, count, out);
+        return;
+    }
+#endif
+    mat4_mul_vec3_soa_scalar(m, positions, count, out);
+}
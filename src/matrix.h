@@ -19,4 +19,5 @@ mat4_t mat4_make_rotation_z(float angle);
 mat4_t mat4_make_perspective(float fov, float aspect, float znear, float zfar);
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v);
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up);
+void mat4_mul_vec3_soa(const mat4_t *m, const vec3_soa_t *positions, int count, vec4_t *out);
 #endif
\ No newline at end of file
@@ -1,51 +1,279 @@
 #include "mesh.h"
 #include "array.h"
+#include "clipping.h"
+#include "simplify.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_NUM_MESHES 10
 
-static mesh_t meshes[MAX_NUM_MESHES];
+static mesh_t *meshes = NULL; // Dynamic array of the shared mesh resources
 static int mesh_count = 0;
 
-void load_mesh(char *obj_filename, char *png_filename, vec3_t scale, vec3_t translation, vec3_t rotation)
+static mesh_instance_t *mesh_instances = NULL; // Dynamic array of the placements of the meshes in the scene
+static int mesh_instance_count = 0;
+
+// Hierarchy over the world space boxes of the instances, used to frustum cull them
+static bvh_t mesh_instance_bvh;
+
+static char *copy_string(const char *string)
+{
+    char *copy = (char *)malloc(strlen(string) + 1);
+    strcpy(copy, string);
+    return copy;
+}
+
+// Loads the geometry and texture of a mesh, or returns the mesh already loaded from the same files in the same texture format
+int load_mesh_resource(char *obj_filename, char *png_filename, texture_format_t texture_format)
+{
+    for (int i = 0; i < mesh_count; i++)
+    {
+        if (strcmp(meshes[i].obj_filename, obj_filename) == 0 && strcmp(meshes[i].png_filename, png_filename) == 0 &&
+            meshes[i].texture_format == texture_format)
+        {
+            return i;
+        }
+    }
+
+    mesh_t mesh = {0};
+    load_mesh_obj_data(&mesh, obj_filename);
+    load_mesh_png_data(&mesh, png_filename, texture_format);
+    mesh.texture_format = texture_format;
+    mesh.obj_filename = copy_string(obj_filename);
+    mesh.png_filename = copy_string(png_filename);
+
+    // Simplify the mesh into its levels of detail (this reorders the vertices)
+    build_mesh_lods(&mesh);
+
+    // Compute the bounding volumes used to cull the whole mesh against the frustum
+    mesh.bounding_box = aabb_from_points(mesh.vertices, array_length(mesh.vertices));
+    mesh.bounding_sphere = sphere_from_points(mesh.vertices, array_length(mesh.vertices));
+
+    // Keep a SoA copy of the positions so they can be transformed several at a time
+    int num_vertices = array_length(mesh.vertices);
+    mesh.vertices_soa = vec3_soa_from_array(mesh.vertices, num_vertices);
+
+    array_push(meshes, mesh);
+    return mesh_count++;
+}
+
+// Places a loaded mesh in the scene, returns the index of the new instance
+int add_mesh_instance(int mesh_index, vec3_t scale, vec3_t translation, vec3_t rotation)
+{
+    mesh_instance_t instance = {
+        .mesh_index = mesh_index,
+        .rotation = rotation,
+        .scale = scale,
+        .translation = translation,
+        .transform_dirty = true,
+        .is_occluder = false};
+    array_push(mesh_instances, instance);
+    return mesh_instance_count++;
+}
+
+// Loads the mesh (only the first time those files are used) and places an instance of it in the scene
+int load_mesh(char *obj_filename, char *png_filename, texture_format_t texture_format, vec3_t scale, vec3_t translation, vec3_t rotation)
+{
+    int mesh_index = load_mesh_resource(obj_filename, png_filename, texture_format);
+    return add_mesh_instance(mesh_index, scale, translation, rotation);
+}
+
+// Instances must be moved through here so the scene hierarchy knows their bounds changed
+void set_mesh_instance_transform(int index, vec3_t scale, vec3_t translation, vec3_t rotation)
+{
+    mesh_instances[index].scale = scale;
+    mesh_instances[index].translation = translation;
+    mesh_instances[index].rotation = rotation;
+    mesh_instances[index].transform_dirty = true;
+}
+
+void set_mesh_instance_occluder(int index, bool is_occluder)
+{
+    mesh_instances[index].is_occluder = is_occluder;
+}
+
+void build_mesh_lods(mesh_t *mesh)
+{
+    // Level 0 is the full detail mesh
+    mesh->lods[0].faces = mesh->faces;
+    mesh->lods[0].num_vertices = array_length(mesh->vertices);
+    mesh->num_lods = 1;
+
+    // Every level halves the number of faces of the previous one
+    int target_faces[MAX_MESH_LODS - 1];
+    int num_targets = 0;
+    int num_faces = array_length(mesh->faces) / 2;
+    while (num_targets < MAX_MESH_LODS - 1 && num_faces >= MIN_LOD_FACES)
+    {
+        target_faces[num_targets++] = num_faces;
+        num_faces /= 2;
+    }
+    if (num_targets == 0)
+    {
+        return;
+    }
+
+    face_t *lod_faces[MAX_MESH_LODS - 1];
+    int lod_num_vertices[MAX_MESH_LODS - 1];
+    int num_levels = simplify_mesh(mesh->vertices, mesh->faces, target_faces, num_targets, lod_faces, lod_num_vertices);
+    for (int i = 0; i < num_levels; i++)
+    {
+        mesh->lods[mesh->num_lods].faces = lod_faces[i];
+        mesh->lods[mesh->num_lods].num_vertices = lod_num_vertices[i];
+        mesh->num_lods++;
+    }
+}
+
+// Picks the level of detail from the radius of the mesh on screen, in pixels
+int select_mesh_lod(mesh_t *mesh, float screen_radius)
+{
+    int level = 0;
+    float radius = LOD_SCREEN_RADIUS;
+    while (level < mesh->num_lods - 1 && screen_radius < radius)
+    {
+        level++;
+        radius /= 2;
+    }
+    return level;
+}
+
+mat4_t get_mesh_instance_world_matrix(mesh_instance_t *instance)
 {
-    load_mesh_obj_data(&meshes[mesh_count], obj_filename);
-    load_mesh_png_data(&meshes[mesh_count], png_filename);
+    // Create a scale, translation and rotation matrix that will be used to multiply the mesh vertices;
+    mat4_t scale_matrix = mat4_make_scale(instance->scale.x, instance->scale.y, instance->scale.z);
+    mat4_t translation_matrix = mat4_make_translation(instance->translation.x, instance->translation.y, instance->translation.z);
+    mat4_t rotation_matrix_x = mat4_make_rotation_x(instance->rotation.x);
+    mat4_t rotation_matrix_y = mat4_make_rotation_y(instance->rotation.y);
+    mat4_t rotation_matrix_z = mat4_make_rotation_z(instance->rotation.z);
 
-    meshes[mesh_count].scale = scale;
-    meshes[mesh_count].translation = translation;
-    meshes[mesh_count].rotation = rotation;
+    mat4_t world_matrix = mat4_identity();
+    // Multiply all matrices and load the world matrix [T]*[R]*[S]*v
+    world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+    world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+    return world_matrix;
+}
 
-    mesh_count++;
+// World space box of an instance, from the model space box of its mesh
+static aabb_t get_mesh_instance_bounds(mesh_instance_t *instance)
+{
+    return aabb_transform(meshes[instance->mesh_index].bounding_box, get_mesh_instance_world_matrix(instance));
 }
 
-void load_mesh_png_data(mesh_t* mesh, char* filename)
+// Rebuilds the hierarchy when instances were added, otherwise only refits the instances that moved
+void update_mesh_instance_bvh(void)
 {
-    upng_t *png_image = upng_new_from_file(filename);
-    if (png_image != NULL)
+    if (mesh_instance_bvh.num_objects != mesh_instance_count)
+    {
+        aabb_t *world_bounds = (aabb_t *)malloc(sizeof(aabb_t) * mesh_instance_count);
+        for (int i = 0; i < mesh_instance_count; i++)
+        {
+            world_bounds[i] = get_mesh_instance_bounds(&mesh_instances[i]);
+            mesh_instances[i].transform_dirty = false;
+        }
+        bvh_build(&mesh_instance_bvh, world_bounds, mesh_instance_count);
+        free(world_bounds);
+        return;
+    }
+
+    for (int i = 0; i < mesh_instance_count; i++)
     {
-        upng_decode(png_image);
-        if (upng_get_error(png_image) == UPNG_EOK)
+        if (mesh_instances[i].transform_dirty)
         {
-            mesh->texture = png_image;
+            bvh_refit(&mesh_instance_bvh, i, get_mesh_instance_bounds(&mesh_instances[i]));
+            mesh_instances[i].transform_dirty = false;
         }
     }
 }
 
+// Returns the instances that touch the frustum (world frustum planes must be up to date)
+void cull_mesh_instances(bvh_visible_t visible_instances[], int *num_visible)
+{
+    bvh_cull(&mesh_instance_bvh, visible_instances, num_visible);
+}
+
+void load_mesh_png_data(mesh_t* mesh, char* filename, texture_format_t format)
+{
+    mesh->texture = load_png_texture(filename, format);
+}
+
 mesh_t *get_mesh(int index)
 {
     return &meshes[index];
 }
+int get_num_mesh_instances(void)
+{
+    return mesh_instance_count;
+}
+mesh_instance_t *get_mesh_instance(int index)
+{
+    return &mesh_instances[index];
+}
 void free_meshes(void)
 {
 
     for (int i = 0; i < mesh_count; i++)
     {
-        upng_free(meshes[i].texture);
+        release_texture(meshes[i].texture);
         array_free(meshes[i].faces);
+        for (int j = 1; j < meshes[i].num_lods; j++)
+        {
+            array_free(meshes[i].lods[j].faces);
+        }
         array_free(meshes[i].vertices);
+        vec3_soa_free(&meshes[i].vertices_soa);
+        free(meshes[i].obj_filename);
+        free(meshes[i].png_filename);
+    }
+    array_free(meshes);
+    meshes = NULL;
+    mesh_count = 0;
+    array_free(mesh_instances);
+    mesh_instances = NULL;
+    mesh_instance_count = 0;
+    bvh_free(&mesh_instance_bvh);
+}
+
+// Transform a range of the unique vertices of the mesh into camera space and clip space, and classify them against the frustum
+// Faces then only need to look them up by index. Meshes known to be inside the frustum pass no outcodes buffer
+// The output buffers are indexed by mesh vertex, so several threads can fill different ranges of the same buffers
+// first_vertex must be a multiple of VEC3_SOA_WIDTH, and the SIMD path writes up to the next multiple after the range
+void transform_mesh_vertices(mesh_t *mesh, mat4_t world_view_matrix, mat4_t world_view_proj_matrix, int first_vertex, int num_vertices,
+                             vec4_t *transformed_vertices, vec4_t *clip_vertices, uint16_t *outcodes)
+{
+    int last_vertex = first_vertex + num_vertices;
+
+    if (mesh->vertices_soa.x != NULL)
+    {
+        // View of the range, the start stays aligned to the SIMD width
+        vec3_soa_t range = mesh->vertices_soa;
+        range.x += first_vertex;
+        range.y += first_vertex;
+        range.z += first_vertex;
+        range.count = num_vertices;
+        range.padded_count -= first_vertex;
+        mat4_mul_vec3_soa(&world_view_matrix, &range, num_vertices, &transformed_vertices[first_vertex]);
+        mat4_mul_vec3_soa(&world_view_proj_matrix, &range, num_vertices, &clip_vertices[first_vertex]);
+    }
+    else
+    {
+        for (int i = first_vertex; i < last_vertex; i++)
+        {
+            vec4_t vertex = vec4_from_vec3(mesh->vertices[i]);
+            transformed_vertices[i] = mat4_mul_vec4(world_view_matrix, vertex);
+            clip_vertices[i] = mat4_mul_vec4(world_view_proj_matrix, vertex);
+        }
+    }
+
+    if (outcodes == NULL)
+    {
+        return;
+    }
+    for (int i = first_vertex; i < last_vertex; i++)
+    {
+        outcodes[i] = compute_outcode(clip_vertices[i]);
     }
 }
 int get_num_meshes(void)
@@ -1,27 +1,81 @@
 #pragma once
 
 #include "vector.h"
+#include "matrix.h"
+#include "bounds.h"
+#include "bvh.h"
 #include "triangle.h"
-#include "upng.h"
+#include "texture.h"
+#include <stdint.h>
+#include <stdbool.h>
 
 
+#define MAX_MESH_LODS 4
+// Meshes with fewer faces than this don't get simplified levels of detail
+#define MIN_LOD_FACES 256
+// Screen space radius (in pixels) under which a mesh switches from level 0 to level 1,
+// every further halving of the radius moves one level down
+#define LOD_SCREEN_RADIUS 120.0
+
+////////////////////////////////////////////////////////////////////////
+// A level of detail is a face list over the same vertices as the mesh
+////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+    face_t *faces;    // Dynamic array of faces, level 0 shares the mesh faces
+    int num_vertices; // The level only references the first num_vertices vertices of the mesh
+} mesh_lod_t;
+
 ////////////////////////////////////////////////////////////////////////
 // Defines a struct for dynamic sized meshes with an array of vertices and faces
+// A mesh only holds shared resources, it is placed in the scene by instances
 ////////////////////////////////////////////////////////////////////////
 typedef struct
 {
     vec3_t *vertices; // Dynamic array of vertices
     face_t *faces;    // Dynamic array of faces
-    upng_t* texture; // Mesh png texture pointer
+    mesh_lod_t lods[MAX_MESH_LODS]; // Levels of detail, from full detail to the coarsest
+    int num_lods;
+    vec3_soa_t vertices_soa; // Optional SoA copy of the vertices used by the SIMD transform
+    texture_t* texture; // Mesh png texture with its mipmaps, shared with the meshes using the same png
+    aabb_t bounding_box;       // Model space box around all the vertices
+    sphere_t bounding_sphere;  // Model space sphere around all the vertices
+    char *obj_filename;        // Files the mesh was loaded from, used to share it between instances
+    char *png_filename;
+    texture_format_t texture_format; // Format the png was loaded in, part of what makes the mesh shared
+
+} mesh_t;
+
+////////////////////////////////////////////////////////////////////////
+// A placement of a mesh in the scene: a transform plus the index of the mesh
+////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+    int mesh_index;
     vec3_t rotation;
     vec3_t scale;
     vec3_t translation;
+    bool transform_dirty; // Set when the transform changed and the scene hierarchy needs a refit
+    bool is_occluder;     // Large mesh drawn into the occlusion buffer to hide the instances behind it
 
-} mesh_t;
+} mesh_instance_t;
 
 void load_mesh_obj_data(mesh_t* mesh, char* filename);
-void load_mesh_png_data(mesh_t* mesh, char* filename);
-void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation);
+void load_mesh_png_data(mesh_t* mesh, char* filename, texture_format_t format);
+int load_mesh_resource(char* obj_filename, char* png_filename, texture_format_t texture_format);
+int add_mesh_instance(int mesh_index, vec3_t scale, vec3_t translation, vec3_t rotation);
+int load_mesh(char* obj_filename, char* png_filename, texture_format_t texture_format, vec3_t scale, vec3_t translation, vec3_t rotation);
 int get_num_meshes(void);
 mesh_t* get_mesh(int index);
-void free_meshes(void);
\ No newline at end of file
+int get_num_mesh_instances(void);
+mesh_instance_t* get_mesh_instance(int index);
+void free_meshes(void);
+void set_mesh_instance_transform(int index, vec3_t scale, vec3_t translation, vec3_t rotation);
+void set_mesh_instance_occluder(int index, bool is_occluder);
+mat4_t get_mesh_instance_world_matrix(mesh_instance_t* instance);
+void update_mesh_instance_bvh(void);
+void cull_mesh_instances(bvh_visible_t visible_instances[], int* num_visible);
+void build_mesh_lods(mesh_t* mesh);
+int select_mesh_lod(mesh_t* mesh, float screen_radius);
+void transform_mesh_vertices(mesh_t* mesh, mat4_t world_view_matrix, mat4_t world_view_proj_matrix, int first_vertex, int num_vertices,
+                             vec4_t* transformed_vertices, vec4_t* clip_vertices, uint16_t* outcodes);
\ No newline at end of file
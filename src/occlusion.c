@@ -0,0 +1,209 @@
+#include "occlusion.h"
+#include "array.h"
+#include "clipping.h"
+#include "triangle.h"
+#include <math.h>
+#include <stddef.h>
+
+static float occlusion_buffer[OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT];
+static int screen_width = 0;
+static int screen_height = 0;
+static int num_occluders = 0; // Occluders drawn since the last clear, nothing can be hidden without any
+
+static bool occlusion_culling = true;
+
+// Vertices of the occluder being drawn, kept between frames
+static vec4_t* occluder_transformed_vertices = NULL;
+static vec4_t* occluder_clip_vertices = NULL;
+static uint16_t* occluder_outcodes = NULL;
+
+typedef struct {
+    float x, y;
+    float reciprocal_w;
+} occluder_vertex_t;
+
+void init_occlusion(int width, int height) {
+    screen_width = width;
+    screen_height = height;
+    clear_occlusion_buffer();
+}
+
+void free_occlusion(void) {
+    array_free(occluder_transformed_vertices);
+    array_free(occluder_clip_vertices);
+    array_free(occluder_outcodes);
+    occluder_transformed_vertices = NULL;
+    occluder_clip_vertices = NULL;
+    occluder_outcodes = NULL;
+}
+
+void clear_occlusion_buffer(void) {
+    for (int i = 0; i < OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT; i++) {
+        occlusion_buffer[i] = 1.0;
+    }
+    num_occluders = 0;
+}
+
+// Same mapping as the geometry stage: perspective divide, then the view scaled to the screen with y flipped
+static occluder_vertex_t project_to_screen(vec4_t v) {
+    occluder_vertex_t vertex = {
+        .x = (v.x / v.w + 1) * (screen_width / 2.0),
+        .y = (1 - v.y / v.w) * (screen_height / 2.0),
+        .reciprocal_w = 1 / v.w
+    };
+    return vertex;
+}
+
+static float edge_function(occluder_vertex_t a, occluder_vertex_t b, float px, float py) {
+    return (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+}
+
+static float clamp_float(float value, float min, float max) {
+    return value < min ? min : (value > max ? max : value);
+}
+
+// Writes the cells the triangle covers completely, with the farthest depth it has over each of them
+static void draw_occluder_triangle(occluder_vertex_t v0, occluder_vertex_t v1, occluder_vertex_t v2) {
+    float area = edge_function(v0, v1, v2.x, v2.y);
+    if (area == 0) {
+        return;
+    }
+    if (area < 0) {
+        occluder_vertex_t temp = v1;
+        v1 = v2;
+        v2 = temp;
+        area = -area;
+    }
+
+    // Size of a cell in screen pixels, every cell is grown by the snap margin before it is tested
+    float cell_width = (float)screen_width / OCCLUSION_BUFFER_WIDTH;
+    float cell_height = (float)screen_height / OCCLUSION_BUFFER_HEIGHT;
+
+    // Cells that can fit inside the box of the triangle, the box is clamped before it is turned into integers
+    float min_x = fmin(v0.x, fmin(v1.x, v2.x)) + OCCLUSION_SNAP_MARGIN;
+    float min_y = fmin(v0.y, fmin(v1.y, v2.y)) + OCCLUSION_SNAP_MARGIN;
+    float max_x = fmax(v0.x, fmax(v1.x, v2.x)) - OCCLUSION_SNAP_MARGIN;
+    float max_y = fmax(v0.y, fmax(v1.y, v2.y)) - OCCLUSION_SNAP_MARGIN;
+    int first_x = (int)ceil(clamp_float(min_x / cell_width, 0, OCCLUSION_BUFFER_WIDTH));
+    int first_y = (int)ceil(clamp_float(min_y / cell_height, 0, OCCLUSION_BUFFER_HEIGHT));
+    int last_x = (int)floor(clamp_float(max_x / cell_width, 0, OCCLUSION_BUFFER_WIDTH)) - 1;
+    int last_y = (int)floor(clamp_float(max_y / cell_height, 0, OCCLUSION_BUFFER_HEIGHT)) - 1;
+
+    for (int cell_y = first_y; cell_y <= last_y; cell_y++) {
+        float corner_y[2] = {cell_y * cell_height - OCCLUSION_SNAP_MARGIN, (cell_y + 1) * cell_height + OCCLUSION_SNAP_MARGIN};
+        for (int cell_x = first_x; cell_x <= last_x; cell_x++) {
+            float corner_x[2] = {cell_x * cell_width - OCCLUSION_SNAP_MARGIN, (cell_x + 1) * cell_width + OCCLUSION_SNAP_MARGIN};
+
+            // The depth is linear on screen, so the farthest depth over the cell is at one of its corners
+            bool covered = true;
+            float far_depth = 0;
+            for (int corner = 0; corner < 4; corner++) {
+                float px = corner_x[corner & 1];
+                float py = corner_y[corner >> 1];
+                float e0 = edge_function(v1, v2, px, py);
+                float e1 = edge_function(v2, v0, px, py);
+                float e2 = edge_function(v0, v1, px, py);
+                if (e0 < 0 || e1 < 0 || e2 < 0) {
+                    covered = false;
+                    break;
+                }
+                float depth = 1.0 - (v0.reciprocal_w * e0 + v1.reciprocal_w * e1 + v2.reciprocal_w * e2) / area;
+                far_depth = corner == 0 || depth > far_depth ? depth : far_depth;
+            }
+
+            float* cell = &occlusion_buffer[cell_y * OCCLUSION_BUFFER_WIDTH + cell_x];
+            if (covered && far_depth < *cell) {
+                *cell = far_depth;
+            }
+        }
+    }
+}
+
+// Only the faces the geometry stage will draw in full can hide anything: faces that cross the near
+// or far plane (they get clipped) and the back faces it culls are left out
+void draw_occluder(mesh_t* mesh, mesh_lod_t* lod, mat4_t world_view_matrix, mat4_t world_view_proj_matrix, bool cull_back_faces) {
+    int num_reserved = (lod->num_vertices + VEC3_SOA_WIDTH - 1) / VEC3_SOA_WIDTH * VEC3_SOA_WIDTH;
+    occluder_transformed_vertices = array_reset(occluder_transformed_vertices);
+    occluder_clip_vertices = array_reset(occluder_clip_vertices);
+    occluder_outcodes = array_reset(occluder_outcodes);
+    occluder_transformed_vertices = array_hold(occluder_transformed_vertices, num_reserved, sizeof(vec4_t));
+    occluder_clip_vertices = array_hold(occluder_clip_vertices, num_reserved, sizeof(vec4_t));
+    occluder_outcodes = array_hold(occluder_outcodes, num_reserved, sizeof(uint16_t));
+
+    transform_mesh_vertices(mesh, world_view_matrix, world_view_proj_matrix, 0, lod->num_vertices,
+                            occluder_transformed_vertices, occluder_clip_vertices, occluder_outcodes);
+
+    int num_faces = array_length(lod->faces);
+    for (int i = 0; i < num_faces; i++) {
+        face_t face = lod->faces[i];
+        if ((occluder_outcodes[face.a] | occluder_outcodes[face.b] | occluder_outcodes[face.c]) & (OUTCODE_NEAR | OUTCODE_FAR)) {
+            continue;
+        }
+
+        if (cull_back_faces) {
+            vec4_t vertices[3] = {occluder_transformed_vertices[face.a], occluder_transformed_vertices[face.b], occluder_transformed_vertices[face.c]};
+            vec3_t normal = get_triangle_normal(vertices);
+            vec3_t camera_ray = vec3_sub(vec3_new(0, 0, 0), vec3_from_vec4(vertices[0]));
+            if (vec3_dot(normal, camera_ray) < 0) {
+                continue;
+            }
+        }
+
+        draw_occluder_triangle(
+            project_to_screen(occluder_clip_vertices[face.a]),
+            project_to_screen(occluder_clip_vertices[face.b]),
+            project_to_screen(occluder_clip_vertices[face.c]));
+    }
+    num_occluders++;
+}
+
+// The box is hidden when its nearest corner is behind the occluders in every cell its screen rect touches
+bool is_box_occluded(aabb_t box, mat4_t world_view_proj_matrix) {
+    if (num_occluders == 0) {
+        return false;
+    }
+
+    vec3_t corners[8];
+    aabb_get_corners(box, corners);
+
+    float min_x = INFINITY, min_y = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY;
+    float nearest_depth = INFINITY;
+    for (int i = 0; i < 8; i++) {
+        vec4_t clip = mat4_mul_vec4(world_view_proj_matrix, vec4_from_vec3(corners[i]));
+        // A box that reaches the camera covers the screen in ways the rect cannot tell
+        if (compute_outcode(clip) & OUTCODE_NEAR) {
+            return false;
+        }
+        occluder_vertex_t vertex = project_to_screen(clip);
+        min_x = fmin(min_x, vertex.x);
+        min_y = fmin(min_y, vertex.y);
+        max_x = fmax(max_x, vertex.x);
+        max_y = fmax(max_y, vertex.y);
+        nearest_depth = fmin(nearest_depth, 1.0 - vertex.reciprocal_w);
+    }
+
+    float cell_width = (float)screen_width / OCCLUSION_BUFFER_WIDTH;
+    float cell_height = (float)screen_height / OCCLUSION_BUFFER_HEIGHT;
+    int first_x = (int)floor(clamp_float((min_x - OCCLUSION_SNAP_MARGIN) / cell_width, 0, OCCLUSION_BUFFER_WIDTH - 1));
+    int first_y = (int)floor(clamp_float((min_y - OCCLUSION_SNAP_MARGIN) / cell_height, 0, OCCLUSION_BUFFER_HEIGHT - 1));
+    int last_x = (int)floor(clamp_float((max_x + OCCLUSION_SNAP_MARGIN) / cell_width, 0, OCCLUSION_BUFFER_WIDTH - 1));
+    int last_y = (int)floor(clamp_float((max_y + OCCLUSION_SNAP_MARGIN) / cell_height, 0, OCCLUSION_BUFFER_HEIGHT - 1));
+
+    for (int cell_y = first_y; cell_y <= last_y; cell_y++) {
+        for (int cell_x = first_x; cell_x <= last_x; cell_x++) {
+            if (nearest_depth - OCCLUSION_DEPTH_MARGIN <= occlusion_buffer[cell_y * OCCLUSION_BUFFER_WIDTH + cell_x]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void set_occlusion_culling(bool enabled) {
+    occlusion_culling = enabled;
+}
+
+bool is_occlusion_culling(void) {
+    return occlusion_culling;
+}
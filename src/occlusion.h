@@ -0,0 +1,34 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <stdbool.h>
+#include "matrix.h"
+#include "bounds.h"
+#include "mesh.h"
+
+#define OCCLUSION_BUFFER_WIDTH 256
+#define OCCLUSION_BUFFER_HEIGHT 128
+// Screen pixels the rasterizer can move an edge by when it snaps the vertices to integers
+#define OCCLUSION_SNAP_MARGIN 2.0
+#define OCCLUSION_DEPTH_MARGIN 1e-4
+
+////////////////////////////////////////////////////////////////////////
+// Mesh level occlusion culling
+////////////////////////////////////////////////////////////////////////
+// The instances marked as occluders are drawn first into a small depth
+// buffer that covers the whole screen. A cell only takes the depth of an
+// occluder triangle that covers all of it, and the farthest depth of the
+// triangle over the cell, so the buffer never claims more than the real
+// image will show. An instance whose bounding box is behind the buffer
+// everywhere it lands on screen is skipped before any of its vertices are
+// transformed.
+////////////////////////////////////////////////////////////////////////
+void init_occlusion(int screen_width, int screen_height);
+void free_occlusion(void);
+void clear_occlusion_buffer(void);
+void draw_occluder(mesh_t* mesh, mesh_lod_t* lod, mat4_t world_view_matrix, mat4_t world_view_proj_matrix, bool cull_back_faces);
+bool is_box_occluded(aabb_t box, mat4_t world_view_proj_matrix);
+void set_occlusion_culling(bool enabled);
+bool is_occlusion_culling(void);
+
+#endif
@@ -0,0 +1,429 @@
+#include "simplify.h"
+#include "array.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Mesh simplification with quadric error metrics (Garland & Heckbert)
+///////////////////////////////////////////////////////////////////////////////
+// Every vertex accumulates the planes of the faces around it in a quadric Q,
+// and the cost of moving it to a point v is v^T Q v, the sum of the squared
+// distances of v to those planes. Edges are collapsed cheapest first.
+//
+// Collapses are half-edge collapses: vertex u is merged into its neighbour v
+// and v keeps its position. No new vertices are created, so every level of
+// detail indexes the same vertex buffer. Vertices are then reordered so the
+// vertices still alive at a level come first, and each level only needs the
+// first lod_num_vertices[i] vertices to be transformed.
+//
+// UVs belong to the faces, so a vertex on a texture seam has a different UV
+// in the faces on each side. Such vertices never move: a face can only take
+// the UV v has in the faces collapsed with the edge, and across a seam that
+// would pull one side's texture over the other.
+///////////////////////////////////////////////////////////////////////////////
+
+// Squared distances to the mesh border are weighted this much more than to faces
+#define BORDER_WEIGHT 1000.0
+// Collapses that turn a face normal by more than ~80 degrees are rejected
+#define MIN_NORMAL_DOT 0.2
+
+// Symmetric 4x4 matrix, only the upper triangle is stored
+typedef struct {
+    double q[10];
+} quadric_t;
+
+typedef struct {
+    double cost;
+    int u, v;                 // Collapse u into v
+    int version_u, version_v; // Versions of u and v when this candidate was computed
+} collapse_t;
+
+typedef struct {
+    vec3_t* vertices;
+    face_t* faces;
+    int num_vertices;
+    int num_faces;
+    quadric_t* quadrics;
+    int** vertex_faces;       // Dynamic array of the faces around each vertex (may contain dead faces)
+    int* versions;            // Bumped every time a vertex changes, invalidates old candidates
+    bool* face_alive;
+    bool* vertex_removed;
+    bool* seam_vertex;        // The faces around the vertex give it different UVs
+    collapse_t* heap;         // Binary min-heap of collapse candidates
+    int heap_count;
+    int heap_capacity;
+} simplifier_t;
+
+static void quadric_add_plane(quadric_t* quadric, double a, double b, double c, double d, double weight) {
+    quadric->q[0] += weight * a * a; quadric->q[1] += weight * a * b; quadric->q[2] += weight * a * c; quadric->q[3] += weight * a * d;
+    quadric->q[4] += weight * b * b; quadric->q[5] += weight * b * c; quadric->q[6] += weight * b * d;
+    quadric->q[7] += weight * c * c; quadric->q[8] += weight * c * d;
+    quadric->q[9] += weight * d * d;
+}
+
+static double quadric_error(const quadric_t* quadric, vec3_t v) {
+    const double* q = quadric->q;
+    double x = v.x, y = v.y, z = v.z;
+    return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+         + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+         + q[7] * z * z + 2 * q[8] * z
+         + q[9];
+}
+
+static void heap_push(simplifier_t* s, collapse_t collapse) {
+    if (s->heap_count == s->heap_capacity) {
+        s->heap_capacity = s->heap_capacity > 0 ? s->heap_capacity * 2 : 1024;
+        s->heap = (collapse_t*)realloc(s->heap, sizeof(collapse_t) * s->heap_capacity);
+    }
+    int i = s->heap_count++;
+    s->heap[i] = collapse;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (s->heap[parent].cost <= s->heap[i].cost) {
+            break;
+        }
+        collapse_t temp = s->heap[parent];
+        s->heap[parent] = s->heap[i];
+        s->heap[i] = temp;
+        i = parent;
+    }
+}
+
+// Removes the cheapest candidate, the heap must not be empty
+static collapse_t heap_pop(simplifier_t* s) {
+    collapse_t top = s->heap[0];
+    int count = --s->heap_count;
+    s->heap[0] = s->heap[count];
+    int i = 0;
+    while (true) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < count && s->heap[left].cost < s->heap[smallest].cost) smallest = left;
+        if (right < count && s->heap[right].cost < s->heap[smallest].cost) smallest = right;
+        if (smallest == i) {
+            break;
+        }
+        collapse_t temp = s->heap[smallest];
+        s->heap[smallest] = s->heap[i];
+        s->heap[i] = temp;
+        i = smallest;
+    }
+    return top;
+}
+
+static int* face_index(face_t* face, int vertex) {
+    if (face->a == vertex) return &face->a;
+    if (face->b == vertex) return &face->b;
+    if (face->c == vertex) return &face->c;
+    return NULL;
+}
+
+static tex2_t* face_uv(face_t* face, int vertex) {
+    if (face->a == vertex) return &face->a_uv;
+    if (face->b == vertex) return &face->b_uv;
+    if (face->c == vertex) return &face->c_uv;
+    return NULL;
+}
+
+static bool same_uv(tex2_t a, tex2_t b) {
+    return a.u == b.u && a.v == b.v;
+}
+
+// UV of v in the faces of edge (u, v), false when they don't agree on it
+static bool edge_target_uv(simplifier_t* s, int u, int v, tex2_t* uv) {
+    bool found = false;
+    for (int i = 0; i < array_length(s->vertex_faces[u]); i++) {
+        int f = s->vertex_faces[u][i];
+        tex2_t* corner = face_uv(&s->faces[f], v);
+        if (!s->face_alive[f] || corner == NULL) {
+            continue;
+        }
+        if (found && !same_uv(*uv, *corner)) {
+            return false;
+        }
+        *uv = *corner;
+        found = true;
+    }
+    return found;
+}
+
+static vec3_t face_normal(vec3_t a, vec3_t b, vec3_t c) {
+    return vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+}
+
+// Pushes the cheaper direction of the collapse of edge (a, b)
+static void push_edge(simplifier_t* s, int a, int b) {
+    quadric_t sum;
+    for (int i = 0; i < 10; i++) {
+        sum.q[i] = s->quadrics[a].q[i] + s->quadrics[b].q[i];
+    }
+    double cost_to_b = quadric_error(&sum, s->vertices[b]);
+    double cost_to_a = quadric_error(&sum, s->vertices[a]);
+    collapse_t collapse = {
+        .cost = cost_to_b <= cost_to_a ? cost_to_b : cost_to_a,
+        .u = cost_to_b <= cost_to_a ? a : b,
+        .v = cost_to_b <= cost_to_a ? b : a,
+    };
+    collapse.version_u = s->versions[collapse.u];
+    collapse.version_v = s->versions[collapse.v];
+    heap_push(s, collapse);
+}
+
+// Pushes a candidate for every edge around the vertex
+static void push_vertex_edges(simplifier_t* s, int vertex) {
+    for (int i = 0; i < array_length(s->vertex_faces[vertex]); i++) {
+        int f = s->vertex_faces[vertex][i];
+        if (!s->face_alive[f]) {
+            continue;
+        }
+        int corners[3] = { s->faces[f].a, s->faces[f].b, s->faces[f].c };
+        for (int j = 0; j < 3; j++) {
+            // Each edge is shared by two faces, push it from the one where it goes from vertex to the next corner
+            if (corners[j] == vertex) {
+                push_edge(s, vertex, corners[(j + 1) % 3]);
+                push_edge(s, corners[(j + 2) % 3], vertex);
+            }
+        }
+    }
+}
+
+// Moving u onto v must not flip or squash any of the faces that stay, nor move a seam
+static bool collapse_is_valid(simplifier_t* s, int u, int v) {
+    tex2_t uv;
+    if (s->seam_vertex[u] || !edge_target_uv(s, u, v, &uv)) {
+        return false;
+    }
+    for (int i = 0; i < array_length(s->vertex_faces[u]); i++) {
+        int f = s->vertex_faces[u][i];
+        face_t* face = &s->faces[f];
+        if (!s->face_alive[f] || face->a == v || face->b == v || face->c == v) {
+            continue;
+        }
+        vec3_t p[3] = { s->vertices[face->a], s->vertices[face->b], s->vertices[face->c] };
+        vec3_t old_normal = face_normal(p[0], p[1], p[2]);
+        *(face->a == u ? &p[0] : face->b == u ? &p[1] : &p[2]) = s->vertices[v];
+        vec3_t new_normal = face_normal(p[0], p[1], p[2]);
+        float old_length = vec3_length(old_normal);
+        float new_length = vec3_length(new_normal);
+        if (new_length == 0 || old_length == 0) {
+            return false;
+        }
+        if (vec3_dot(old_normal, new_normal) < MIN_NORMAL_DOT * old_length * new_length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Merges u into v, returns the number of faces that became degenerate and were removed
+static int collapse_edge(simplifier_t* s, int u, int v) {
+    // The corners that move take the UV of v, so the texture stays where it was around v
+    tex2_t uv;
+    edge_target_uv(s, u, v, &uv);
+    int removed_faces = 0;
+    for (int i = 0; i < array_length(s->vertex_faces[u]); i++) {
+        int f = s->vertex_faces[u][i];
+        if (!s->face_alive[f]) {
+            continue;
+        }
+        face_t* face = &s->faces[f];
+        if (face->a == v || face->b == v || face->c == v) {
+            s->face_alive[f] = false;
+            removed_faces++;
+            continue;
+        }
+        *face_uv(face, u) = uv;
+        *face_index(face, u) = v;
+        array_push(s->vertex_faces[v], f);
+    }
+    for (int i = 0; i < 10; i++) {
+        s->quadrics[v].q[i] += s->quadrics[u].q[i];
+    }
+    s->vertex_removed[u] = true;
+    s->versions[u]++;
+    s->versions[v]++;
+    return removed_faces;
+}
+
+static void init_seam_vertices(simplifier_t* s) {
+    for (int vertex = 0; vertex < s->num_vertices; vertex++) {
+        int* around = s->vertex_faces[vertex];
+        for (int i = 1; i < array_length(around) && !s->seam_vertex[vertex]; i++) {
+            s->seam_vertex[vertex] = !same_uv(*face_uv(&s->faces[around[0]], vertex), *face_uv(&s->faces[around[i]], vertex));
+        }
+    }
+}
+
+static void init_quadrics(simplifier_t* s) {
+    for (int f = 0; f < s->num_faces; f++) {
+        face_t face = s->faces[f];
+        vec3_t a = s->vertices[face.a];
+        vec3_t b = s->vertices[face.b];
+        vec3_t c = s->vertices[face.c];
+        vec3_t normal = face_normal(a, b, c);
+        float length = vec3_length(normal);
+        if (length == 0) {
+            continue;
+        }
+        normal = vec3_div(normal, length);
+        double d = -vec3_dot(normal, a);
+        // Weight every plane by the area of its face
+        int corners[3] = { face.a, face.b, face.c };
+        for (int j = 0; j < 3; j++) {
+            quadric_add_plane(&s->quadrics[corners[j]], normal.x, normal.y, normal.z, d, length * 0.5);
+        }
+
+        // Edges with no face on the other side are mesh borders: add a plane
+        // perpendicular to the face through the edge so collapses don't pull the border inwards
+        for (int j = 0; j < 3; j++) {
+            int e0 = corners[j];
+            int e1 = corners[(j + 1) % 3];
+            bool shared = false;
+            for (int k = 0; k < array_length(s->vertex_faces[e1]) && !shared; k++) {
+                face_t other = s->faces[s->vertex_faces[e1][k]];
+                // The neighbour across the edge walks it the other way round
+                shared = (other.a == e1 && other.b == e0) || (other.b == e1 && other.c == e0) || (other.c == e1 && other.a == e0);
+            }
+            if (shared) {
+                continue;
+            }
+            vec3_t edge = vec3_sub(s->vertices[e1], s->vertices[e0]);
+            vec3_t border_normal = vec3_cross(edge, normal);
+            float border_length = vec3_length(border_normal);
+            if (border_length == 0) {
+                continue;
+            }
+            border_normal = vec3_div(border_normal, border_length);
+            double border_d = -vec3_dot(border_normal, s->vertices[e0]);
+            quadric_add_plane(&s->quadrics[e0], border_normal.x, border_normal.y, border_normal.z, border_d, BORDER_WEIGHT);
+            quadric_add_plane(&s->quadrics[e1], border_normal.x, border_normal.y, border_normal.z, border_d, BORDER_WEIGHT);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds one level of detail for each target face count (in decreasing order)
+///////////////////////////////////////////////////////////////////////////////
+// lod_faces[i] receives a new dynamic array of faces and lod_num_vertices[i]
+// the number of vertices it uses. The vertices are reordered in place and the
+// indices of faces (the full detail faces) are remapped to match. Returns the
+// number of levels built, which is less than num_targets when the mesh can't
+// be simplified any further.
+///////////////////////////////////////////////////////////////////////////////
+int simplify_mesh(vec3_t* vertices, face_t* faces, const int target_faces[], int num_targets,
+                  face_t* lod_faces[], int lod_num_vertices[]) {
+    simplifier_t s = { 0 };
+    s.vertices = vertices;
+    s.num_vertices = array_length(vertices);
+    s.num_faces = array_length(faces);
+    s.faces = (face_t*)malloc(sizeof(face_t) * s.num_faces);
+    memcpy(s.faces, faces, sizeof(face_t) * s.num_faces);
+    s.quadrics = (quadric_t*)calloc(s.num_vertices, sizeof(quadric_t));
+    s.vertex_faces = (int**)calloc(s.num_vertices, sizeof(int*));
+    s.versions = (int*)calloc(s.num_vertices, sizeof(int));
+    s.vertex_removed = (bool*)calloc(s.num_vertices, sizeof(bool));
+    s.seam_vertex = (bool*)calloc(s.num_vertices, sizeof(bool));
+    s.face_alive = (bool*)malloc(sizeof(bool) * s.num_faces);
+
+    for (int f = 0; f < s.num_faces; f++) {
+        s.face_alive[f] = true;
+        array_push(s.vertex_faces[s.faces[f].a], f);
+        array_push(s.vertex_faces[s.faces[f].b], f);
+        array_push(s.vertex_faces[s.faces[f].c], f);
+    }
+    init_seam_vertices(&s);
+    init_quadrics(&s);
+    for (int f = 0; f < s.num_faces; f++) {
+        push_edge(&s, s.faces[f].a, s.faces[f].b);
+        push_edge(&s, s.faces[f].b, s.faces[f].c);
+        push_edge(&s, s.faces[f].c, s.faces[f].a);
+    }
+
+    // Removal order of the vertices, used to sort them at the end
+    int* removed_order = (int*)malloc(sizeof(int) * s.num_vertices);
+    int num_removed = 0;
+    int* num_removed_at_level = (int*)malloc(sizeof(int) * (num_targets > 0 ? num_targets : 1));
+
+    int live_faces = s.num_faces;
+    int num_levels = 0;
+    while (num_levels < num_targets) {
+        while (live_faces > target_faces[num_levels] && s.heap_count > 0) {
+            collapse_t collapse = heap_pop(&s);
+            if (s.vertex_removed[collapse.u] || s.vertex_removed[collapse.v] ||
+                collapse.version_u != s.versions[collapse.u] || collapse.version_v != s.versions[collapse.v]) {
+                continue;
+            }
+            if (!collapse_is_valid(&s, collapse.u, collapse.v)) {
+                continue;
+            }
+            live_faces -= collapse_edge(&s, collapse.u, collapse.v);
+            removed_order[num_removed++] = collapse.u;
+            push_vertex_edges(&s, collapse.v);
+        }
+        if (live_faces > target_faces[num_levels]) {
+            break;
+        }
+
+        // Snapshot the live faces as this level (indices are remapped below)
+        lod_faces[num_levels] = NULL;
+        for (int f = 0; f < s.num_faces; f++) {
+            if (s.face_alive[f]) {
+                array_push(lod_faces[num_levels], s.faces[f]);
+            }
+        }
+        num_removed_at_level[num_levels] = num_removed;
+        num_levels++;
+    }
+
+    // New order: vertices never removed first, then the removed ones from the last removed to the first
+    int* new_index = (int*)malloc(sizeof(int) * s.num_vertices);
+    int next = 0;
+    for (int vertex = 0; vertex < s.num_vertices; vertex++) {
+        if (!s.vertex_removed[vertex]) {
+            new_index[vertex] = next++;
+        }
+    }
+    for (int i = num_removed - 1; i >= 0; i--) {
+        new_index[removed_order[i]] = next++;
+    }
+
+    vec3_t* original_vertices = (vec3_t*)malloc(sizeof(vec3_t) * s.num_vertices);
+    memcpy(original_vertices, vertices, sizeof(vec3_t) * s.num_vertices);
+    for (int vertex = 0; vertex < s.num_vertices; vertex++) {
+        vertices[new_index[vertex]] = original_vertices[vertex];
+    }
+    for (int f = 0; f < s.num_faces; f++) {
+        faces[f].a = new_index[faces[f].a];
+        faces[f].b = new_index[faces[f].b];
+        faces[f].c = new_index[faces[f].c];
+    }
+    for (int level = 0; level < num_levels; level++) {
+        for (int f = 0; f < array_length(lod_faces[level]); f++) {
+            lod_faces[level][f].a = new_index[lod_faces[level][f].a];
+            lod_faces[level][f].b = new_index[lod_faces[level][f].b];
+            lod_faces[level][f].c = new_index[lod_faces[level][f].c];
+        }
+        // Vertices removed after this level are still needed by it, and they come right after the survivors
+        lod_num_vertices[level] = s.num_vertices - num_removed_at_level[level];
+    }
+
+    free(original_vertices);
+    free(new_index);
+    free(removed_order);
+    for (int vertex = 0; vertex < s.num_vertices; vertex++) {
+        array_free(s.vertex_faces[vertex]);
+    }
+    free(num_removed_at_level);
+    free(s.heap);
+    free(s.vertex_faces);
+    free(s.face_alive);
+    free(s.vertex_removed);
+    free(s.seam_vertex);
+    free(s.versions);
+    free(s.quadrics);
+    free(s.faces);
+    return num_levels;
+}
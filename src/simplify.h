@@ -0,0 +1,10 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "vector.h"
+#include "triangle.h"
+
+int simplify_mesh(vec3_t* vertices, face_t* faces, const int target_faces[], int num_targets,
+                  face_t* lod_faces[], int lod_num_vertices[]);
+
+#endif
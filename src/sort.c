@@ -0,0 +1,57 @@
+#include "sort.h"
+#include <string.h>
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+void radix_sort(uint64_t* keys, int* values, int count, uint64_t* key_scratch, int* value_scratch) {
+    // The histograms of every pass are counted in a single read of the keys
+    int histograms[RADIX_PASSES][RADIX_SIZE] = {{0}};
+    for (int i = 0; i < count; i++) {
+        uint64_t key = keys[i];
+        for (int pass = 0; pass < RADIX_PASSES; pass++) {
+            histograms[pass][(key >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1)]++;
+        }
+    }
+
+    uint64_t* source_keys = keys;
+    int* source_values = values;
+    uint64_t* target_keys = key_scratch;
+    int* target_values = value_scratch;
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        int* histogram = histograms[pass];
+        int shift = pass * RADIX_BITS;
+
+        // Every key has the same digit, the order does not change
+        if (count == 0 || histogram[(source_keys[0] >> shift) & (RADIX_SIZE - 1)] == count) {
+            continue;
+        }
+
+        // Turn the counts into the first slot of every digit
+        int offset = 0;
+        for (int digit = 0; digit < RADIX_SIZE; digit++) {
+            int digit_count = histogram[digit];
+            histogram[digit] = offset;
+            offset += digit_count;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int slot = histogram[(source_keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+            target_keys[slot] = source_keys[i];
+            target_values[slot] = source_values[i];
+        }
+
+        uint64_t* swap_keys = source_keys;
+        source_keys = target_keys;
+        target_keys = swap_keys;
+        int* swap_values = source_values;
+        source_values = target_values;
+        target_values = swap_values;
+    }
+
+    if (source_keys != keys) {
+        memcpy(keys, source_keys, sizeof(uint64_t) * count);
+        memcpy(values, source_values, sizeof(int) * count);
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////
+// Radix sort of 64-bit keys carrying an int each
+////////////////////////////////////////////////////////////////////////
+// Least significant byte first, so the sort is stable: equal keys keep
+// the order they came in. A byte that is the same in every key is skipped
+// without moving anything, keys that only use a few bytes sort quickly.
+// The scratch arrays must hold count items, the result is left in keys and
+// values.
+////////////////////////////////////////////////////////////////////////
+void radix_sort(uint64_t* keys, int* values, int count, uint64_t* key_scratch, int* value_scratch);
+
+#endif
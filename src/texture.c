@@ -1,7 +1,16 @@
 #include "texture.h"
+#include "upng.h"
+#include "cpu.h"
+#include "array.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#if defined(CPU_X86)
+#include <immintrin.h>
+#endif
 
+static texture_filter_t texture_filter = TEXTURE_FILTER_NEAREST_MIPMAP;
 
 tex2_t tex2_clone(tex2_t* tex) {
     tex2_t result = {
@@ -10,3 +19,481 @@ tex2_t tex2_clone(tex2_t* tex) {
     };
     return result;
 }
+
+// Average of four texels, every 8-bit channel rounded to the nearest
+static uint32_t average_texels(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    // Two channels at a time, each in 16 bits so the sums do not run into the next one
+    uint32_t mask = 0x00FF00FF;
+    uint32_t even = (((a & mask) + (b & mask) + (c & mask) + (d & mask) + 0x00020002) >> 2) & mask;
+    uint32_t odd = ((((a >> 8) & mask) + ((b >> 8) & mask) + ((c >> 8) & mask) + ((d >> 8) & mask) + 0x00020002) >> 2) & mask;
+    return even | (odd << 8);
+}
+
+// Box filter of the level above, the last row or column of an odd sized level is used twice
+static void build_texture_level(const texture_level_t* source, texture_level_t* level) {
+    for (int y = 0; y < level->height; y++) {
+        int y0 = 2 * y < source->height ? 2 * y : source->height - 1;
+        int y1 = 2 * y + 1 < source->height ? 2 * y + 1 : source->height - 1;
+        for (int x = 0; x < level->width; x++) {
+            int x0 = 2 * x < source->width ? 2 * x : source->width - 1;
+            int x1 = 2 * x + 1 < source->width ? 2 * x + 1 : source->width - 1;
+            level->texels[texel_index(level, x, y)] = average_texels(
+                source->texels[texel_index(source, x0, y0)], source->texels[texel_index(source, x1, y0)],
+                source->texels[texel_index(source, x0, y1)], source->texels[texel_index(source, x1, y1)]);
+        }
+    }
+}
+
+// Words of the level in whole tiles, a texel each or a block each
+static int get_level_storage(const texture_level_t* level, texture_format_t format) {
+    int tile_rows = (level->height + TEXTURE_TILE_SIZE - 1) >> TEXTURE_TILE_SHIFT;
+    int tile_words = format == TEXTURE_FORMAT_BC1 ? 2 : TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+    return level->tiles_per_row * tile_rows * tile_words;
+}
+
+// Sizes of the whole chain from the size of level 0 and its format, all the levels live in a single allocation
+static void allocate_texture_levels(texture_t* texture) {
+    int num_texels = 0;
+    int width = texture->width;
+    int height = texture->height;
+    texture->num_levels = 0;
+    while (texture->num_levels < MAX_TEXTURE_LEVELS) {
+        texture_level_t* level = &texture->levels[texture->num_levels++];
+        level->width = width;
+        level->height = height;
+        level->tiles_per_row = (width + TEXTURE_TILE_SIZE - 1) >> TEXTURE_TILE_SHIFT;
+        num_texels += get_level_storage(level, texture->format);
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    // The padding of the tiles is never sampled, it is cleared so it holds no garbage.
+    // Every level is a whole number of tiles (or 8-byte blocks), so aligning the first one aligns them all.
+    texture->memory = calloc(1, sizeof(uint32_t) * num_texels + TEXTURE_ALIGNMENT);
+    uintptr_t aligned = ((uintptr_t)texture->memory + TEXTURE_ALIGNMENT - 1) & ~(uintptr_t)(TEXTURE_ALIGNMENT - 1);
+    uint32_t* texels = (uint32_t*)aligned;
+    for (int i = 0; i < texture->num_levels; i++) {
+        texture->levels[i].texels = texels;
+        texels += get_level_storage(&texture->levels[i], texture->format);
+    }
+}
+
+static void destroy_texture(texture_t* texture) {
+    free(texture->memory);
+    free(texture);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Import of the decoded png
+////////////////////////////////////////////////////////////////////////
+// upng leaves the image in the format of the file. Every row is turned
+// into texels of the color buffer: grey goes into R, G and B, images
+// without alpha become opaque, 16-bit channels keep their high byte and
+// grey under 8 bits is scaled up to the whole 0..255 range. The common
+// 8-bit formats are converted with SIMD, the rest texel by texel.
+////////////////////////////////////////////////////////////////////////
+
+// Bits of the image from the given bit on, png packs them from the most significant
+static unsigned read_image_bits(const unsigned char* image, unsigned long bit, unsigned count) {
+    unsigned value = 0;
+    for (unsigned i = 0; i < count; i++, bit++) {
+        value = (value << 1) | ((image[bit >> 3] >> (7 - (bit & 7))) & 1);
+    }
+    return value;
+}
+
+static void write_texel(unsigned char* texel, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    texel[0] = r;
+    texel[1] = g;
+    texel[2] = b;
+    texel[3] = a;
+}
+
+// Converts the texels from x to the end of row y, false for a format that cannot be imported
+static bool convert_texels(upng_format format, const unsigned char* image, int width, int y, int x, unsigned char* row) {
+    unsigned long first = (unsigned long)y * width; // Index of the first texel of the row in the image
+    for (; x < width; x++) {
+        unsigned long i = first + x;
+        unsigned char* texel = &row[4 * x];
+        switch (format) {
+        case UPNG_RGBA8:
+            memcpy(texel, &image[4 * i], 4);
+            break;
+        case UPNG_RGB8:
+            write_texel(texel, image[3 * i], image[3 * i + 1], image[3 * i + 2], 0xFF);
+            break;
+        case UPNG_RGBA16:
+            write_texel(texel, image[8 * i], image[8 * i + 2], image[8 * i + 4], image[8 * i + 6]);
+            break;
+        case UPNG_RGB16:
+            write_texel(texel, image[6 * i], image[6 * i + 2], image[6 * i + 4], 0xFF);
+            break;
+        case UPNG_LUMINANCE8:
+            write_texel(texel, image[i], image[i], image[i], 0xFF);
+            break;
+        case UPNG_LUMINANCE_ALPHA8:
+            write_texel(texel, image[2 * i], image[2 * i], image[2 * i], image[2 * i + 1]);
+            break;
+        case UPNG_LUMINANCE1:
+        case UPNG_LUMINANCE2:
+        case UPNG_LUMINANCE4: {
+            unsigned bits = format == UPNG_LUMINANCE1 ? 1 : (format == UPNG_LUMINANCE2 ? 2 : 4);
+            unsigned char grey = read_image_bits(image, i * bits, bits) * 255 / ((1 << bits) - 1);
+            write_texel(texel, grey, grey, grey, 0xFF);
+            break;
+        }
+        case UPNG_LUMINANCE_ALPHA1:
+        case UPNG_LUMINANCE_ALPHA2:
+        case UPNG_LUMINANCE_ALPHA4: {
+            unsigned bits = format == UPNG_LUMINANCE_ALPHA1 ? 1 : (format == UPNG_LUMINANCE_ALPHA2 ? 2 : 4);
+            unsigned max = (1 << bits) - 1;
+            unsigned char grey = read_image_bits(image, 2 * i * bits, bits) * 255 / max;
+            unsigned char alpha = read_image_bits(image, (2 * i + 1) * bits, bits) * 255 / max;
+            write_texel(texel, grey, grey, grey, alpha);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+#if defined(CPU_X86)
+// 4 texels of 3 bytes are spread to 4 bytes each, the 4th byte of each texel is made opaque
+CPU_TARGET("ssse3")
+static int convert_rgb8_ssse3(const unsigned char* image, int width, int y, unsigned char* row) {
+    const unsigned char* source = &image[3 * (unsigned long)y * width];
+    __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m128i opaque = _mm_set1_epi32(0xFF000000);
+    int x = 0;
+    // 16 bytes are read for the 12 of every block, the last texels are left to the scalar loop
+    for (; x + 6 <= width; x += 4) {
+        __m128i rgb = _mm_loadu_si128((const __m128i*)&source[3 * x]);
+        _mm_storeu_si128((__m128i*)&row[4 * x], _mm_or_si128(_mm_shuffle_epi8(rgb, spread), opaque));
+    }
+    return x;
+}
+
+// 16 grey bytes are repeated into 16 texels, the 4th byte of each texel is made opaque
+CPU_TARGET("sse2")
+static int convert_luminance8_sse2(const unsigned char* image, int width, int y, unsigned char* row) {
+    const unsigned char* source = &image[(unsigned long)y * width];
+    __m128i opaque = _mm_set1_epi32(0xFF000000);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i grey = _mm_loadu_si128((const __m128i*)&source[x]);
+        __m128i pairs_low = _mm_unpacklo_epi8(grey, grey);
+        __m128i pairs_high = _mm_unpackhi_epi8(grey, grey);
+        _mm_storeu_si128((__m128i*)&row[4 * x], _mm_or_si128(_mm_unpacklo_epi16(pairs_low, pairs_low), opaque));
+        _mm_storeu_si128((__m128i*)&row[4 * x + 16], _mm_or_si128(_mm_unpackhi_epi16(pairs_low, pairs_low), opaque));
+        _mm_storeu_si128((__m128i*)&row[4 * x + 32], _mm_or_si128(_mm_unpacklo_epi16(pairs_high, pairs_high), opaque));
+        _mm_storeu_si128((__m128i*)&row[4 * x + 48], _mm_or_si128(_mm_unpackhi_epi16(pairs_high, pairs_high), opaque));
+    }
+    return x;
+}
+#endif
+
+// One row of the image into texels of the color buffer
+static bool convert_row(upng_format format, const unsigned char* image, int width, int y, unsigned char* row) {
+    int x = 0;
+#if defined(CPU_X86)
+    // SSSE3 comes with every CPU of the SSE4.1 path
+    if (format == UPNG_RGB8 && get_cpu_path() >= CPU_PATH_SSE41) {
+        x = convert_rgb8_ssse3(image, width, y, row);
+    }
+    if (format == UPNG_LUMINANCE8 && get_cpu_path() >= CPU_PATH_SSE2) {
+        x = convert_luminance8_sse2(image, width, y, row);
+    }
+#endif
+    return convert_texels(format, image, width, y, x, row);
+}
+
+// Decodes the png into level 0 of a new texture (in tiles), the other levels are left to build
+static texture_t* import_png_texture(upng_t* png_image) {
+    upng_format format = upng_get_format(png_image);
+    int width = upng_get_width(png_image);
+    int height = upng_get_height(png_image);
+    if (format == UPNG_BADFORMAT || width <= 0 || height <= 0) {
+        return NULL;
+    }
+
+    texture_t* texture = (texture_t*)malloc(sizeof(texture_t));
+    texture->width = width;
+    texture->height = height;
+    texture->is_power_of_two = (width & (width - 1)) == 0 && (height & (height - 1)) == 0;
+    texture->format = TEXTURE_FORMAT_RGBA8;
+    allocate_texture_levels(texture);
+
+    texture_level_t* base = &texture->levels[0];
+    const unsigned char* image = upng_get_buffer(png_image);
+    uint32_t* row = (uint32_t*)malloc(sizeof(uint32_t) * width);
+    for (int y = 0; y < height; y++) {
+        if (!convert_row(format, image, width, y, (unsigned char*)row)) {
+            free(row);
+            destroy_texture(texture);
+            return NULL;
+        }
+        // The 4 texels of a row of a tile are next to each other
+        for (int x = 0; x < width; x++) {
+            base->texels[texel_index(base, x, y)] = row[x];
+        }
+    }
+    free(row);
+    return texture;
+}
+
+// Decodes a whole png file held in memory, with its mip chain
+static texture_t* decode_png_texture(const unsigned char* bytes, unsigned long size) {
+    upng_t* png_image = upng_new_from_bytes(bytes, size);
+    if (png_image == NULL) {
+        return NULL;
+    }
+    upng_decode(png_image);
+    if (upng_get_error(png_image) != UPNG_EOK) {
+        upng_free(png_image);
+        return NULL;
+    }
+
+    texture_t* texture = import_png_texture(png_image);
+    upng_free(png_image);
+    if (texture == NULL) {
+        return NULL;
+    }
+    for (int i = 1; i < texture->num_levels; i++) {
+        build_texture_level(&texture->levels[i - 1], &texture->levels[i]);
+    }
+    return texture;
+}
+
+////////////////////////////////////////////////////////////////////////
+// BC1 compression
+////////////////////////////////////////////////////////////////////////
+// Every tile of the decoded levels is turned into a block. The two colors
+// are the two texels of the tile furthest apart, so the line between them
+// follows the colors of the tile whatever their direction, and every
+// texel takes the selector of the nearest of the 4 colors the sampler
+// decodes. Texels of the padding are left out and keep selector 0.
+////////////////////////////////////////////////////////////////////////
+static uint32_t pack_rgb565(uint32_t texel) {
+    uint32_t r = ((texel & 0xFF) * 31 + 127) / 255;
+    uint32_t g = (((texel >> 8) & 0xFF) * 63 + 127) / 255;
+    uint32_t b = (((texel >> 16) & 0xFF) * 31 + 127) / 255;
+    return (r << 11) | (g << 5) | b;
+}
+
+static int color_distance(uint32_t a, uint32_t b) {
+    int dr = (int)(a & 0xFF) - (int)(b & 0xFF);
+    int dg = (int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF);
+    int db = (int)((a >> 16) & 0xFF) - (int)((b >> 16) & 0xFF);
+    return dr * dr + dg * dg + db * db;
+}
+
+static void encode_block(const uint32_t* tile_texels, int count, const int* tile_positions, uint32_t* block) {
+    uint32_t end0 = tile_texels[0];
+    uint32_t end1 = tile_texels[0];
+    int furthest = -1;
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            int distance = color_distance(tile_texels[i], tile_texels[j]);
+            if (distance > furthest) {
+                furthest = distance;
+                end0 = tile_texels[i];
+                end1 = tile_texels[j];
+            }
+        }
+    }
+    block[0] = pack_rgb565(end0) | (pack_rgb565(end1) << 16);
+    block[1] = 0;
+
+    uint32_t colors[4];
+    for (int selector = 0; selector < 4; selector++) {
+        block[1] = (uint32_t)selector;
+        colors[selector] = decode_block_texel(block, 0);
+    }
+    block[1] = 0;
+    for (int i = 0; i < count; i++) {
+        int best = 0;
+        for (int selector = 1; selector < 4; selector++) {
+            if (color_distance(tile_texels[i], colors[selector]) < color_distance(tile_texels[i], colors[best])) {
+                best = selector;
+            }
+        }
+        block[1] |= (uint32_t)best << (2 * tile_positions[i]);
+    }
+}
+
+static void encode_level(const texture_level_t* source, texture_level_t* level) {
+    int tile_rows = (level->height + TEXTURE_TILE_SIZE - 1) >> TEXTURE_TILE_SHIFT;
+    for (int tile_y = 0; tile_y < tile_rows; tile_y++) {
+        for (int tile_x = 0; tile_x < level->tiles_per_row; tile_x++) {
+            uint32_t tile_texels[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE];
+            int tile_positions[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE];
+            int count = 0;
+            for (int y = tile_y * TEXTURE_TILE_SIZE; y < (tile_y + 1) * TEXTURE_TILE_SIZE && y < source->height; y++) {
+                for (int x = tile_x * TEXTURE_TILE_SIZE; x < (tile_x + 1) * TEXTURE_TILE_SIZE && x < source->width; x++) {
+                    int index = texel_index(source, x, y);
+                    tile_texels[count] = source->texels[index];
+                    tile_positions[count++] = index & (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE - 1);
+                }
+            }
+            encode_block(tile_texels, count, tile_positions, &level->texels[2 * (tile_y * level->tiles_per_row + tile_x)]);
+        }
+    }
+}
+
+// Replaces the texels of every level with their blocks
+static void compress_texture(texture_t* texture) {
+    texture_t source = *texture;
+    texture->format = TEXTURE_FORMAT_BC1;
+    allocate_texture_levels(texture);
+    for (int i = 0; i < texture->num_levels; i++) {
+        encode_level(&source.levels[i], &texture->levels[i]);
+    }
+    free(source.memory);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Texture cache
+////////////////////////////////////////////////////////////////////////
+// Many meshes of a scene use the same few pngs. A texture is decoded the
+// first time its file is loaded, the next loads of the same path in the
+// same format get the same texture without reading the file again. A file
+// under another path is read and hashed: if its bytes are the ones of a
+// texture already loaded in that format, it shares that one too. Every
+// load takes a reference, the texture is freed when the last one is
+// released.
+////////////////////////////////////////////////////////////////////////
+typedef struct {
+    char* filename;            // NULL for a free slot
+    uint64_t content_hash;     // FNV-1a of the bytes of the file
+    unsigned long content_size;
+    texture_t* texture;        // Shared by every entry of the same content
+} texture_cache_entry_t;
+
+static texture_cache_entry_t* texture_cache = NULL; // Dynamic array, one entry per path loaded
+
+static uint64_t hash_bytes(const unsigned char* bytes, unsigned long size) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (unsigned long i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// The whole file in a new buffer, NULL if it cannot be read
+static unsigned char* read_file(const char* filename, unsigned long* size) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* bytes = length > 0 ? (unsigned char*)malloc(length) : NULL;
+    if (bytes == NULL || fread(bytes, 1, length, file) != (size_t)length) {
+        free(bytes);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = (unsigned long)length;
+    return bytes;
+}
+
+// Returns the slot of the entry, a free one is reused
+static int add_texture_cache_entry(const char* filename, uint64_t content_hash, unsigned long content_size, texture_t* texture) {
+    texture_cache_entry_t entry = {
+        .filename = (char*)malloc(strlen(filename) + 1),
+        .content_hash = content_hash,
+        .content_size = content_size,
+        .texture = texture
+    };
+    strcpy(entry.filename, filename);
+    for (int i = 0; i < array_length(texture_cache); i++) {
+        if (texture_cache[i].filename == NULL) {
+            texture_cache[i] = entry;
+            return i;
+        }
+    }
+    array_push(texture_cache, entry);
+    return array_length(texture_cache) - 1;
+}
+
+texture_t* load_png_texture(const char* filename, texture_format_t format) {
+    for (int i = 0; i < array_length(texture_cache); i++) {
+        texture_cache_entry_t* entry = &texture_cache[i];
+        if (entry->filename != NULL && entry->texture->format == format && strcmp(entry->filename, filename) == 0) {
+            entry->texture->reference_count++;
+            return entry->texture;
+        }
+    }
+
+    unsigned long size = 0;
+    unsigned char* bytes = read_file(filename, &size);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    uint64_t content_hash = hash_bytes(bytes, size);
+    texture_t* texture = NULL;
+    for (int i = 0; i < array_length(texture_cache); i++) {
+        texture_cache_entry_t* entry = &texture_cache[i];
+        if (entry->filename != NULL && entry->texture->format == format && entry->content_hash == content_hash && entry->content_size == size) {
+            texture = entry->texture;
+            texture->reference_count++;
+            break;
+        }
+    }
+    if (texture == NULL) {
+        texture = decode_png_texture(bytes, size);
+        if (texture != NULL) {
+            if (format == TEXTURE_FORMAT_BC1) {
+                compress_texture(texture);
+            }
+            texture->reference_count = 1;
+        }
+    }
+    free(bytes);
+    if (texture != NULL) {
+        int slot = add_texture_cache_entry(filename, content_hash, size, texture);
+        // The slot of the first path stays taken as long as the texture lives
+        if (texture->reference_count == 1) {
+            texture->id = slot;
+        }
+    }
+    return texture;
+}
+
+void release_texture(texture_t* texture) {
+    if (texture == NULL || --texture->reference_count > 0) {
+        return;
+    }
+    // Every path of the texture leaves the cache with it, the array goes with the last one
+    bool cache_empty = true;
+    for (int i = 0; i < array_length(texture_cache); i++) {
+        texture_cache_entry_t* entry = &texture_cache[i];
+        if (entry->texture == texture) {
+            free(entry->filename);
+            entry->filename = NULL;
+            entry->texture = NULL;
+        }
+        cache_empty = cache_empty && entry->filename == NULL;
+    }
+    if (cache_empty) {
+        array_free(texture_cache);
+        texture_cache = NULL;
+    }
+    destroy_texture(texture);
+}
+
+// Must not change while tiles are being drawn, the triangles read it when they are set up
+void set_texture_filter(texture_filter_t filter) {
+    texture_filter = filter;
+}
+
+texture_filter_t get_texture_filter(void) {
+    return texture_filter;
+}
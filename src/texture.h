@@ -1,6 +1,9 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 typedef struct {
     float u;
     float v;
@@ -8,5 +11,121 @@ typedef struct {
 
 tex2_t tex2_clone(tex2_t* tex);
 
+// Enough levels for a 32768 texels wide texture
+#define MAX_TEXTURE_LEVELS 16
+// Texels on the side of a tile, a tile of 4x4 32-bit texels fills one 64 byte cache line (and is one BC1 block)
+#define TEXTURE_TILE_SHIFT 2
+#define TEXTURE_TILE_SIZE (1 << TEXTURE_TILE_SHIFT)
+// The levels start on a cache line so the tiles do not straddle two of them
+#define TEXTURE_ALIGNMENT 64
+
+////////////////////////////////////////////////////////////////////////
+// Mipmapped textures
+////////////////////////////////////////////////////////////////////////
+// The texture is decoded once and kept as a chain of levels, each one half
+// the size of the one before (rounded down, never under 1) down to 1x1.
+// Every texel of a level is the average of the 2x2 texels under it. A
+// pixel far from the camera covers many texels of level 0, sampling the
+// level where it covers about one texel keeps the texel fetches close
+// together in memory and stops distant surfaces from shimmering.
+//
+// A level is stored in square tiles, row by row, instead of in rows of
+// texels: the texels a triangle samples around a pixel are neighbours in
+// both directions, whatever the rotation of the texture on screen, and a
+// tile keeps them in the same cache line. The levels are padded to whole
+// tiles, texel_index gives where a texel is.
+//
+// Whatever the format of the png, the texels are imported once into the
+// 32-bit layout of the color buffer (bytes R, G, B, A in memory), so the
+// sampler only ever reads whole texels. A level is all the sampler needs.
+//
+// A texture can instead be kept compressed, one 64-bit block per tile in
+// the way of BC1: two RGB565 colors and a 2-bit selector per texel that
+// picks one of them or a point 1/3 or 2/3 of the way between. That is 8
+// times less memory than whole texels, so many more textures stay in the
+// caches while shading, for colors that are only close to the png ones
+// and no alpha. The format is picked for every texture when it is loaded,
+// fetch_texel decodes a texel of either format.
+////////////////////////////////////////////////////////////////////////
+typedef enum {
+    TEXTURE_FORMAT_RGBA8, // 32 bits per texel, exact
+    TEXTURE_FORMAT_BC1    // 4 bits per texel, opaque, 4 colors per tile
+} texture_format_t;
+
+typedef struct {
+    int width;
+    int height;
+    int tiles_per_row;
+    uint32_t* texels; // RGBA8: same 32-bit layout as the color buffer, in tiles. BC1: two words per tile
+} texture_level_t;
+
+typedef struct {
+    int width; // Size of level 0
+    int height;
+    bool is_power_of_two; // Both sizes are, and so are the ones of every level: coordinates wrap with a mask
+    int num_levels;
+    void* memory; // Unaligned block that owns the texels of every level
+    int reference_count; // Loads of the texture not released yet
+    int id; // Small number no other loaded texture has, used to group the triangles by texture
+    texture_format_t format;
+    texture_level_t levels[MAX_TEXTURE_LEVELS];
+} texture_t;
+
+typedef enum {
+    TEXTURE_FILTER_NEAREST,        // Nearest texel of level 0, no mipmaps
+    TEXTURE_FILTER_NEAREST_MIPMAP, // Nearest texel of the level closest to the pixel footprint
+    TEXTURE_FILTER_TRILINEAR       // Bilinear in the two levels around the footprint, blended between them
+} texture_filter_t;
+
+// Position of the texel (x, y) in the tiles of the level, the coordinates must be inside the level
+static inline int texel_index(const texture_level_t* level, int x, int y) {
+    int tile = (y >> TEXTURE_TILE_SHIFT) * level->tiles_per_row + (x >> TEXTURE_TILE_SHIFT);
+    int texel = ((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_SHIFT) | (x & (TEXTURE_TILE_SIZE - 1));
+    return (tile << (2 * TEXTURE_TILE_SHIFT)) | texel;
+}
+
+// Blend of two texels, every 8-bit channel weighted from 0 (all a) to 256 (all b)
+static inline uint32_t blend_texels(uint32_t a, uint32_t b, int weight) {
+    // Two channels at a time, each in 16 bits so the products do not run into the next one
+    uint32_t mask = 0x00FF00FF;
+    uint32_t even = (((a & mask) * (256 - weight) + (b & mask) * weight) >> 8) & mask;
+    uint32_t odd = ((((a >> 8) & mask) * (256 - weight) + ((b >> 8) & mask) * weight) >> 8) & mask;
+    return even | (odd << 8);
+}
+
+// Opaque texel of a RGB565 color, the high bits of each channel are repeated in its low bits
+static inline uint32_t expand_rgb565(uint32_t color) {
+    uint32_t r = (color >> 11) & 31;
+    uint32_t g = (color >> 5) & 63;
+    uint32_t b = color & 31;
+    return ((r << 3) | (r >> 2)) | (((g << 2) | (g >> 4)) << 8) | (((b << 3) | (b >> 2)) << 16) | 0xFF000000;
+}
+
+// Texel of a BC1 block: the first word holds the colors (color 0 in the low half), the second the
+// selector of texel i of the tile in bits 2i and 2i+1. Selectors 0 and 1 are the two colors, 2 and 3
+// the points 1/3 and 2/3 of the way from color 0 to color 1.
+static inline uint32_t decode_block_texel(const uint32_t* block, int texel) {
+    static const int weights[4] = {0, 256, 85, 171};
+    int selector = (block[1] >> (2 * texel)) & 3;
+    return blend_texels(expand_rgb565(block[0] & 0xFFFF), expand_rgb565(block[0] >> 16), weights[selector]);
+}
+
+// Texel (x, y) of a level of the texture in the layout of the color buffer, whatever the format it is kept in
+static inline uint32_t fetch_texel(const texture_t* texture, const texture_level_t* level, int x, int y) {
+    int index = texel_index(level, x, y);
+    if (texture->format == TEXTURE_FORMAT_BC1) {
+        return decode_block_texel(&level->texels[2 * (index >> (2 * TEXTURE_TILE_SHIFT))], index & (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE - 1));
+    }
+    return level->texels[index];
+}
+
+// Texture of the png in the given format, shared with the earlier loads in that format of the same path
+// or of a file with the same bytes. Every load must be matched by a release, NULL if the file cannot be
+// read or decoded.
+texture_t* load_png_texture(const char* filename, texture_format_t format);
+void release_texture(texture_t* texture);
+
+void set_texture_filter(texture_filter_t filter);
+texture_filter_t get_texture_filter(void);
 
-#endif
\ No newline at end of file
+#endif
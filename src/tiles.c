@@ -0,0 +1,90 @@
+#include "tiles.h"
+#include "array.h"
+#include <math.h>
+#include <stdlib.h>
+
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+static int screen_width = 0;
+static int screen_height = 0;
+
+// Dynamic array of triangle indices for every tile, reset (not freed) every frame
+static int** tile_triangles = NULL;
+
+void init_tiles(int width, int height) {
+    screen_width = width;
+    screen_height = height;
+    num_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    num_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    tile_triangles = (int**)calloc(num_tiles_x * num_tiles_y, sizeof(int*));
+}
+
+void free_tiles(void) {
+    for (int i = 0; i < num_tiles_x * num_tiles_y; i++) {
+        array_free(tile_triangles[i]);
+    }
+    free(tile_triangles);
+    tile_triangles = NULL;
+    num_tiles_x = 0;
+    num_tiles_y = 0;
+}
+
+static int clamp_int(int value, int min, int max) {
+    return value < min ? min : (value > max ? max : value);
+}
+
+void bin_triangles(triangle_t* triangles, int num_triangles) {
+    int num_tiles = num_tiles_x * num_tiles_y;
+    for (int i = 0; i < num_tiles; i++) {
+        tile_triangles[i] = array_reset(tile_triangles[i]);
+    }
+
+    for (int i = 0; i < num_triangles; i++) {
+        vec4_t* points = triangles[i].points;
+        float min_x = fmin(points[0].x, fmin(points[1].x, points[2].x));
+        float min_y = fmin(points[0].y, fmin(points[1].y, points[2].y));
+        float max_x = fmax(points[0].x, fmax(points[1].x, points[2].x));
+        float max_y = fmax(points[0].y, fmax(points[1].y, points[2].y));
+
+        // Skip triangles that are entirely off screen (guard band), and clamp the
+        // box to the screen before it is turned into integers
+        if (max_x < -TILE_BIN_MARGIN || max_y < -TILE_BIN_MARGIN ||
+            min_x >= screen_width + TILE_BIN_MARGIN || min_y >= screen_height + TILE_BIN_MARGIN) {
+            continue;
+        }
+        int first_x = clamp_int((int)floor(min_x) - TILE_BIN_MARGIN, 0, screen_width - 1) / TILE_SIZE;
+        int first_y = clamp_int((int)floor(min_y) - TILE_BIN_MARGIN, 0, screen_height - 1) / TILE_SIZE;
+        int last_x = clamp_int((int)ceil(max_x) + TILE_BIN_MARGIN, 0, screen_width - 1) / TILE_SIZE;
+        int last_y = clamp_int((int)ceil(max_y) + TILE_BIN_MARGIN, 0, screen_height - 1) / TILE_SIZE;
+
+        for (int tile_y = first_y; tile_y <= last_y; tile_y++) {
+            for (int tile_x = first_x; tile_x <= last_x; tile_x++) {
+                array_push(tile_triangles[tile_y * num_tiles_x + tile_x], i);
+            }
+        }
+    }
+}
+
+int get_num_tiles(void) {
+    return num_tiles_x * num_tiles_y;
+}
+
+rect_t get_tile_rect(int tile_index) {
+    int tile_x = tile_index % num_tiles_x;
+    int tile_y = tile_index / num_tiles_x;
+    rect_t rect = {
+        .x_min = tile_x * TILE_SIZE,
+        .y_min = tile_y * TILE_SIZE,
+        .x_max = fmin((tile_x + 1) * TILE_SIZE, screen_width),
+        .y_max = fmin((tile_y + 1) * TILE_SIZE, screen_height)
+    };
+    return rect;
+}
+
+int* get_tile_triangles(int tile_index) {
+    return tile_triangles[tile_index];
+}
+
+int get_num_tile_triangles(int tile_index) {
+    return array_length(tile_triangles[tile_index]);
+}
@@ -0,0 +1,26 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include "display.h"
+#include "triangle.h"
+
+#define TILE_SIZE 64
+#define TILE_BIN_MARGIN 4 // The vertex dots reach 3 pixels out of the triangle, plus one for rounding
+
+////////////////////////////////////////////////////////////////////////
+// Screen tiles and the triangles that touch each of them
+////////////////////////////////////////////////////////////////////////
+// Triangles are binned by their screen bounding box, keeping the order
+// they were submitted in, so a tile can be drawn on its own and still get
+// exactly the pixels the whole screen would. Tiles never overlap, so they
+// can be drawn by different threads at the same time.
+////////////////////////////////////////////////////////////////////////
+void init_tiles(int screen_width, int screen_height);
+void free_tiles(void);
+void bin_triangles(triangle_t* triangles, int num_triangles);
+int get_num_tiles(void);
+rect_t get_tile_rect(int tile_index);
+int* get_tile_triangles(int tile_index);
+int get_num_tile_triangles(int tile_index);
+
+#endif
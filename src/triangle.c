@@ -1,6 +1,15 @@
 #include "triangle.h"
 #include "swap.h"
 #include "display.h"
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#endif
 
 /* Draw a filled triangle with a flat top, by starting from the lowest point
 //          (x0,y0)------(x1,y1)
@@ -75,316 +84,1107 @@ vec3_t get_triangle_normal(vec4_t vertices[3])
     vec3_normalize(&normal);
     return normal;
 }
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color, rect_t clip)
 {
-    draw_line(x0, y0, x1, y1, color);
-    draw_line(x1, y1, x2, y2, color);
-    draw_line(x2, y2, x0, y0, color);
+    draw_line(x0, y0, x1, y1, color, clip);
+    draw_line(x1, y1, x2, y2, color, clip);
+    draw_line(x2, y2, x0, y0, color, clip);
 }
-void draw_filled_triangle(int x0, int y0, float z0, float w0,
-                          int x1, int y1, float z1, float w1,
-                          int x2, int y2, float z2, float w2,
-                          uint32_t color)
+////////////////////////////////////////////////////////////////////////
+// Edge function rasterization
+////////////////////////////////////////////////////////////////////////
+// Every edge of the triangle is a line equation that is positive on the
+// inside. The equations are set up once per triangle, then stepped with an
+// add per pixel: the three edge values of a pixel are also its barycentric
+// weights times twice the area of the triangle.
+////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+    int min_x, min_y, max_x, max_y; // Box around the triangle inside the clip rect (inclusive)
+    int start[3];  // Edge values at (min_x, min_y), edge i is opposite to vertex i
+    int step_x[3]; // Change of the edge values for one pixel to the right
+    int step_y[3]; // Change of the edge values for one row down
+    int bias[3];   // -1 for the edges that do not own the pixels exactly on them
+} triangle_edges_t;
+
+// Twice the signed area of the triangle a,b,p: positive when p is on the inside of the edge a->b
+static int edge_function(int ax, int ay, int bx, int by, int px, int py)
 {
+    return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+}
 
-    // We need to sort the vertices by their y coordinate ascending (y0 < y1 < y2)
-    if (y0 > y1)
+// Top-left rule: pixels exactly on an edge belong to the triangle only if it is a top or a left edge,
+// so two triangles that share an edge never both draw its pixels (y grows downwards)
+static bool is_top_left_edge(int ax, int ay, int bx, int by)
+{
+    int dx = bx - ax;
+    int dy = by - ay;
+    return dy < 0 || (dy == 0 && dx > 0);
+}
+
+// Sets up the edge equations of a triangle with a positive area, returns false when no pixel of the clip rect can be covered
+static bool setup_triangle_edges(int x[3], int y[3], rect_t clip, triangle_edges_t *edges)
+{
+    int area = edge_function(x[0], y[0], x[1], y[1], x[2], y[2]);
+    if (area <= 0)
     {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
+        return false;
     }
-    if (y1 > y2)
+
+    edges->min_x = x[0] < x[1] ? (x[0] < x[2] ? x[0] : x[2]) : (x[1] < x[2] ? x[1] : x[2]);
+    edges->min_y = y[0] < y[1] ? (y[0] < y[2] ? y[0] : y[2]) : (y[1] < y[2] ? y[1] : y[2]);
+    edges->max_x = x[0] > x[1] ? (x[0] > x[2] ? x[0] : x[2]) : (x[1] > x[2] ? x[1] : x[2]);
+    edges->max_y = y[0] > y[1] ? (y[0] > y[2] ? y[0] : y[2]) : (y[1] > y[2] ? y[1] : y[2]);
+
+    // Scissor the box to the clip rect, triangles may extend into the guard band or other tiles
+    if (edges->min_x < clip.x_min)
+        edges->min_x = clip.x_min;
+    if (edges->min_y < clip.y_min)
+        edges->min_y = clip.y_min;
+    if (edges->max_x > clip.x_max - 1)
+        edges->max_x = clip.x_max - 1;
+    if (edges->max_y > clip.y_max - 1)
+        edges->max_y = clip.y_max - 1;
+    if (edges->min_x > edges->max_x || edges->min_y > edges->max_y)
     {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
+        return false;
     }
-    if (y0 > y1)
+
+    for (int i = 0; i < 3; i++)
     {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
+        int a = (i + 1) % 3;
+        int b = (i + 2) % 3;
+        edges->start[i] = edge_function(x[a], y[a], x[b], y[b], edges->min_x, edges->min_y);
+        edges->step_x[i] = y[a] - y[b];
+        edges->step_y[i] = x[b] - x[a];
+        edges->bias[i] = is_top_left_edge(x[a], y[a], x[b], y[b]) ? 0 : -1;
     }
+    return true;
+}
 
-    // Create vector points after we sort the vertices
-    vec4_t point_a = {x0, y0, z0, w0};
-    vec4_t point_b = {x1, y1, z1, w1};
-    vec4_t point_c = {x2, y2, z2, w2};
+// Both winding orders are drawn (back faces can be kept), the vertices are swapped to make the area positive
+static bool is_clockwise(int x0, int y0, int x1, int y1, int x2, int y2)
+{
+    return edge_function(x0, y0, x1, y1, x2, y2) < 0;
+}
 
-    // vec3_t weights = barycentric_weights(a, b, c, point_p);
-    // Render the upper part of the triangle (flat-bottom)
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
+////////////////////////////////////////////////////////////////////////
+// Attribute planes
+////////////////////////////////////////////////////////////////////////
+// 1/w, u/w and v/w are linear in screen space: each of them is a plane
+// with a value at the first vertex and a change per pixel in x and in y.
+// The gradients are worked out once per triangle, a pixel then costs a
+// multiply and an add per attribute instead of blending the three vertices
+// with the barycentric weights. The planes are evaluated from the row start
+// rather than stepped pixel by pixel, so a pixel gets the same value whatever
+// span, tile or pass it is drawn in, and on every CPU path.
+////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+    float value; // At the first vertex of the triangle
+    float d_dx;  // Change for one pixel to the right
+    float d_dy;  // Change for one row down
+} attribute_plane_t;
 
-    if (y1 - y0 != 0)
-        inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-    if (y2 - y0 != 0)
-        inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+typedef struct
+{
+    int origin_x, origin_y; // First vertex, where the planes have their value
+    attribute_plane_t reciprocal_w;
+    attribute_plane_t u_over_w;
+    attribute_plane_t v_over_w;
+    float nearest_depth; // No pixel of the triangle gets a smaller depth
+    uint32_t color;
+    const texture_t *texture;
+    float texture_width; // Size of level 0, the derivatives of u and v are scaled to its texels
+    float texture_height;
+    texture_filter_t texture_filter;
+    bool depth_equal; // Depth test against the values of a depth pre-pass instead of the nearest so far
+} triangle_attributes_t;
+
+// Gradients of the values of the vertices, from the differences to the first vertex (the area is positive)
+static void setup_attribute_plane(const int x[3], const int y[3], const float value[3], attribute_plane_t *plane)
+{
+    double area = edge_function(x[0], y[0], x[1], y[1], x[2], y[2]);
+    double dx1 = x[1] - x[0], dy1 = y[1] - y[0];
+    double dx2 = x[2] - x[0], dy2 = y[2] - y[0];
+    double dv1 = value[1] - value[0];
+    double dv2 = value[2] - value[0];
+
+    plane->value = value[0];
+    plane->d_dx = (dv1 * dy2 - dv2 * dy1) / area;
+    plane->d_dy = (dx1 * dv2 - dx2 * dv1) / area;
+}
+
+// Value of the plane at the start of the row dy below the first vertex
+static float plane_row_value(const attribute_plane_t *plane, int dy)
+{
+    return plane->value + dy * plane->d_dy;
+}
 
-    if (y1 - y0 != 0)
+// Value of the plane dx pixels to the right of the first vertex, on the row that starts with row_value
+static float plane_value(float row_value, const attribute_plane_t *plane, int dx)
+{
+    return row_value + dx * plane->d_dx;
+}
+
+// The 1/w plane every kind of triangle needs, and the nearest depth the hierarchical test compares with
+static void setup_depth_plane(const int x[3], const int y[3], const float reciprocal_w[3], triangle_attributes_t *attributes)
+{
+    attributes->origin_x = x[0];
+    attributes->origin_y = y[0];
+    setup_attribute_plane(x, y, reciprocal_w, &attributes->reciprocal_w);
+
+    // The pixels are inside the triangle, so the exact plane is never above the largest 1/w of the vertices.
+    // Evaluating it in float (with rounded gradients) adds a few roundings of the terms that are summed.
+    const attribute_plane_t *plane = &attributes->reciprocal_w;
+    int extent_x = abs(x[1] - x[0]) > abs(x[2] - x[0]) ? abs(x[1] - x[0]) : abs(x[2] - x[0]);
+    int extent_y = abs(y[1] - y[0]) > abs(y[2] - y[0]) ? abs(y[1] - y[0]) : abs(y[2] - y[0]);
+    double rounding = 4 * FLT_EPSILON * (fabs(plane->value) + extent_x * fabs(plane->d_dx) + extent_y * fabs(plane->d_dy));
+    double max_reciprocal_w = fmax(reciprocal_w[0], fmax(reciprocal_w[1], reciprocal_w[2])) + rounding;
+    attributes->nearest_depth = 1.0 - max_reciprocal_w - FLT_EPSILON * (1.0 + fabs(max_reciprocal_w));
+}
+
+////////////////////////////////////////////////////////////////////////
+// Row kernels
+////////////////////////////////////////////////////////////////////////
+// Shade the pixels of row y of the triangle box from x_start to x_end, e
+// holds the edge values at x_start. The SIMD paths test coverage and depth on a block of 8 (AVX2)
+// or 4 (SSE2) pixels at once and write color and depth back with a blend,
+// so the pixels that fail keep their old values. Blocks never reach past
+// x_end: the last pixels of the row go through the scalar loop. Every lane
+// does the same operations in the same order as the scalar loop, so all the
+// paths give the same image. The kernel is picked once per triangle from
+// the active CPU path (AVX-512 uses the AVX2 kernels, SSE4.1 the SSE2 ones).
+////////////////////////////////////////////////////////////////////////
+static depth_test_t depth_test = DEPTH_TEST_LESS;
+
+// Must not change while tiles are being drawn, the triangles read it when they are set up
+void set_depth_test(depth_test_t test)
+{
+    depth_test = test;
+}
+
+depth_test_t get_depth_test(void)
+{
+    return depth_test;
+}
+
+// With the equal test a pixel is only shaded by the first triangle at the depth of the pre-pass: the depth
+// of the pixels it shades is moved out of reach, as the less test does for the triangles that come after
+#define SHADED_DEPTH -INFINITY
+
+static bool pass_depth_test(float depth, float old_depth, bool equal)
+{
+    return equal ? depth == old_depth : depth < old_depth;
+}
+
+// Returns true when any pixel passed the depth test
+typedef bool (*row_kernel_t)(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row);
+
+////////////////////////////////////////////////////////////////////////
+// Texture sampling
+////////////////////////////////////////////////////////////////////////
+// The level is picked per pixel from the footprint of the pixel in texels:
+// u = (u/w) / (1/w), so its derivatives come straight from the planes as
+// du/dx = (d(u/w)/dx - u * d(1/w)/dx) * w, and the same along y and for v.
+// The kernels only compute the footprint, the level and the texel fetches
+// are done lane by lane by the same scalar code on every path.
+////////////////////////////////////////////////////////////////////////
+
+// Square of the longest side of the pixel in texels of level 0
+static float texel_footprint(const triangle_attributes_t *attributes, float u, float v, float w)
+{
+    float du_dx = (attributes->u_over_w.d_dx - u * attributes->reciprocal_w.d_dx) * w * attributes->texture_width;
+    float dv_dx = (attributes->v_over_w.d_dx - v * attributes->reciprocal_w.d_dx) * w * attributes->texture_height;
+    float du_dy = (attributes->u_over_w.d_dy - u * attributes->reciprocal_w.d_dy) * w * attributes->texture_width;
+    float dv_dy = (attributes->v_over_w.d_dy - v * attributes->reciprocal_w.d_dy) * w * attributes->texture_height;
+    float footprint_x = du_dx * du_dx + dv_dx * dv_dx;
+    float footprint_y = du_dy * du_dy + dv_dy * dv_dy;
+    return footprint_x > footprint_y ? footprint_x : footprint_y;
+}
+
+// Wrap the texel coordinates into the texture, repeating it on both sides of 0.
+// Power of two sizes only need a mask, the others the remainder moved to the positive side.
+static int wrap_texel_coordinate(int coordinate, int size, bool is_power_of_two)
+{
+    if (is_power_of_two)
     {
-        for (int y = y0; y <= y1; y++)
+        return coordinate & (size - 1);
+    }
+    coordinate %= size;
+    return coordinate < 0 ? coordinate + size : coordinate;
+}
+
+static uint32_t sample_nearest(const texture_t *texture, const texture_level_t *level, float u, float v)
+{
+    // Map the UV coordinate to the full texture width and height
+    int tex_x = wrap_texel_coordinate((int)(u * level->width), level->width, texture->is_power_of_two);
+    int tex_y = wrap_texel_coordinate((int)(v * level->height), level->height, texture->is_power_of_two);
+    return fetch_texel(texture, level, tex_x, tex_y);
+}
+
+// The four texels around the sample point, texel centers are at half coordinates
+static uint32_t sample_bilinear(const texture_t *texture, const texture_level_t *level, float u, float v)
+{
+    float x = u * level->width - 0.5f;
+    float y = v * level->height - 0.5f;
+    float x_floor = floorf(x);
+    float y_floor = floorf(y);
+    int weight_x = (int)((x - x_floor) * 256);
+    int weight_y = (int)((y - y_floor) * 256);
+
+    int x0 = wrap_texel_coordinate((int)x_floor, level->width, texture->is_power_of_two);
+    int x1 = wrap_texel_coordinate((int)x_floor + 1, level->width, texture->is_power_of_two);
+    int y0 = wrap_texel_coordinate((int)y_floor, level->height, texture->is_power_of_two);
+    int y1 = wrap_texel_coordinate((int)y_floor + 1, level->height, texture->is_power_of_two);
+    uint32_t top = blend_texels(fetch_texel(texture, level, x0, y0), fetch_texel(texture, level, x1, y0), weight_x);
+    uint32_t bottom = blend_texels(fetch_texel(texture, level, x0, y1), fetch_texel(texture, level, x1, y1), weight_x);
+    return blend_texels(top, bottom, weight_y);
+}
+
+static uint32_t sample_texture(const triangle_attributes_t *attributes, float u, float v, float footprint)
+{
+    const texture_t *texture = attributes->texture;
+    if (attributes->texture_filter == TEXTURE_FILTER_NEAREST_MIPMAP)
+    {
+        // Level of log2 of the footprint side rounded to the nearest: half the exponent of twice its square.
+        // Footprints under a texel land below 0 and take level 0, so does a footprint that is not a number
+        // (its exponent bits are all ones, it would take the coarsest level).
+        if (!(footprint >= 0))
         {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+            return sample_nearest(texture, &texture->levels[0], u, v);
+        }
+        float doubled = 2 * footprint;
+        uint32_t bits;
+        memcpy(&bits, &doubled, sizeof(bits));
+        int level = (((int)(bits >> 23) & 0xFF) - 127) / 2;
+        level = level < 0 ? 0 : (level >= texture->num_levels ? texture->num_levels - 1 : level);
+        return sample_nearest(texture, &texture->levels[level], u, v);
+    }
+    if (attributes->texture_filter == TEXTURE_FILTER_TRILINEAR)
+    {
+        float lod = 0.5f * log2f(footprint);
+        if (!(lod > 0))
+        {
+            return sample_bilinear(texture, &texture->levels[0], u, v);
+        }
+        if (lod >= texture->num_levels - 1)
+        {
+            return sample_bilinear(texture, &texture->levels[texture->num_levels - 1], u, v);
+        }
+        int level = (int)lod;
+        int weight = (int)((lod - level) * 256);
+        return blend_texels(sample_bilinear(texture, &texture->levels[level], u, v), sample_bilinear(texture, &texture->levels[level + 1], u, v), weight);
+    }
+    return sample_nearest(texture, &texture->levels[0], u, v);
+}
 
-            if (x_end < x_start)
+// Also finishes the rows of the SIMD kernels, from x to x_end with the edge values e at x
+static bool draw_flat_row_scalar(const triangle_edges_t *edges, int y, int x, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    int e0 = e[0];
+    int e1 = e[1];
+    int e2 = e[2];
+    float reciprocal_w_row = plane_row_value(&attributes->reciprocal_w, y - attributes->origin_y);
+    bool wrote = false;
+    for (; x <= x_end; x++)
+    {
+        // Inside when no biased edge value is negative
+        if (((e0 + edges->bias[0]) | (e1 + edges->bias[1]) | (e2 + edges->bias[2])) >= 0)
+        {
+            // Adjust 1/w so the pixel that are closer to the viewer have smaller values (bcs 1/2 > 1/3)
+            float depth = 1.0 - plane_value(reciprocal_w_row, &attributes->reciprocal_w, x - attributes->origin_x);
+
+            // Only draw the pixel if the depth value is less than the one previous stored in the zbuffer
+            if (pass_depth_test(depth, z_row[x], attributes->depth_equal))
             {
-                int_swap(&x_start, &x_end);
+                color_row[x] = attributes->color;
+                z_row[x] = attributes->depth_equal ? SHADED_DEPTH : depth;
+                wrote = true;
             }
+        }
+        e0 += edges->step_x[0];
+        e1 += edges->step_x[1];
+        e2 += edges->step_x[2];
+    }
+    return wrote;
+}
 
-            for (int x = x_start; x < x_end; x++)
-            {
+#if defined(CPU_X86)
+CPU_TARGET("avx2")
+static inline __m256 depth_test_avx2(__m256 depth, __m256 old_depth, bool equal)
+{
+    return equal ? _mm256_cmp_ps(depth, old_depth, _CMP_EQ_OQ) : _mm256_cmp_ps(depth, old_depth, _CMP_LT_OQ);
+}
 
-                // Draw our pixel with the color that comes from the texture
-                draw_triangle_pixel(x, y, point_a, point_b, point_c, color);
-            }
+CPU_TARGET("sse2")
+static inline __m128 depth_test_sse2(__m128 depth, __m128 old_depth, bool equal)
+{
+    return equal ? _mm_cmpeq_ps(depth, old_depth) : _mm_cmplt_ps(depth, old_depth);
+}
+
+CPU_TARGET("avx2")
+static bool draw_flat_row_avx2(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    int x = x_start;
+    int e0 = e[0];
+    int e1 = e[1];
+    int e2 = e[2];
+    bool wrote = false;
+
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i e0_block = _mm256_add_epi32(_mm256_set1_epi32(e0), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[0])));
+    __m256i e1_block = _mm256_add_epi32(_mm256_set1_epi32(e1), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[1])));
+    __m256i e2_block = _mm256_add_epi32(_mm256_set1_epi32(e2), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[2])));
+    __m256i e0_step = _mm256_set1_epi32(edges->step_x[0] * 8);
+    __m256i e1_step = _mm256_set1_epi32(edges->step_x[1] * 8);
+    __m256i e2_step = _mm256_set1_epi32(edges->step_x[2] * 8);
+    __m256i bias0 = _mm256_set1_epi32(edges->bias[0]);
+    __m256i bias1 = _mm256_set1_epi32(edges->bias[1]);
+    __m256i bias2 = _mm256_set1_epi32(edges->bias[2]);
+    __m256i minus_one = _mm256_set1_epi32(-1);
+    __m256i dx_block = _mm256_add_epi32(_mm256_set1_epi32(x - attributes->origin_x), lanes);
+    __m256i dx_step = _mm256_set1_epi32(8);
+    __m256 reciprocal_w_row = _mm256_set1_ps(plane_row_value(&attributes->reciprocal_w, y - attributes->origin_y));
+    __m256 reciprocal_w_dx = _mm256_set1_ps(attributes->reciprocal_w.d_dx);
+    __m256 one = _mm256_set1_ps(1.0);
+    __m256i color = _mm256_set1_epi32(attributes->color);
+
+    for (; x + 7 <= x_end; x += 8)
+    {
+        __m256i edge_or = _mm256_or_si256(_mm256_add_epi32(e0_block, bias0), _mm256_or_si256(_mm256_add_epi32(e1_block, bias1), _mm256_add_epi32(e2_block, bias2)));
+        __m256 inside = _mm256_castsi256_ps(_mm256_cmpgt_epi32(edge_or, minus_one));
+        if (_mm256_movemask_ps(inside) != 0)
+        {
+            __m256 depth = _mm256_sub_ps(one, _mm256_add_ps(reciprocal_w_row, _mm256_mul_ps(_mm256_cvtepi32_ps(dx_block), reciprocal_w_dx)));
+
+            __m256 old_depth = _mm256_loadu_ps(&z_row[x]);
+            __m256 pass = _mm256_and_ps(inside, depth_test_avx2(depth, old_depth, attributes->depth_equal));
+            wrote |= _mm256_movemask_ps(pass) != 0;
+            _mm256_storeu_ps(&z_row[x], _mm256_blendv_ps(old_depth, attributes->depth_equal ? _mm256_set1_ps(SHADED_DEPTH) : depth, pass));
+            __m256i old_color = _mm256_loadu_si256((__m256i *)&color_row[x]);
+            _mm256_storeu_si256((__m256i *)&color_row[x], _mm256_blendv_epi8(old_color, color, _mm256_castps_si256(pass)));
         }
+        e0_block = _mm256_add_epi32(e0_block, e0_step);
+        e1_block = _mm256_add_epi32(e1_block, e1_step);
+        e2_block = _mm256_add_epi32(e2_block, e2_step);
+        dx_block = _mm256_add_epi32(dx_block, dx_step);
     }
 
-    // Render the bottom part of the triangle (flat-top)
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
+    // The pixels left after the last whole block
+    int skipped = x - x_start;
+    int e_left[3] = {e[0] + skipped * edges->step_x[0], e[1] + skipped * edges->step_x[1], e[2] + skipped * edges->step_x[2]};
+    return draw_flat_row_scalar(edges, y, x, x_end, e_left, attributes, color_row, z_row) || wrote;
+}
+
+CPU_TARGET("sse2")
+static bool draw_flat_row_sse2(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    int x = x_start;
+    int e0 = e[0];
+    int e1 = e[1];
+    int e2 = e[2];
+    bool wrote = false;
 
-    if (y2 - y1 != 0)
-        inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-    if (y2 - y0 != 0)
-        inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+    __m128i e0_block = _mm_setr_epi32(e0, e0 + edges->step_x[0], e0 + edges->step_x[0] * 2, e0 + edges->step_x[0] * 3);
+    __m128i e1_block = _mm_setr_epi32(e1, e1 + edges->step_x[1], e1 + edges->step_x[1] * 2, e1 + edges->step_x[1] * 3);
+    __m128i e2_block = _mm_setr_epi32(e2, e2 + edges->step_x[2], e2 + edges->step_x[2] * 2, e2 + edges->step_x[2] * 3);
+    __m128i e0_step = _mm_set1_epi32(edges->step_x[0] * 4);
+    __m128i e1_step = _mm_set1_epi32(edges->step_x[1] * 4);
+    __m128i e2_step = _mm_set1_epi32(edges->step_x[2] * 4);
+    __m128i bias0 = _mm_set1_epi32(edges->bias[0]);
+    __m128i bias1 = _mm_set1_epi32(edges->bias[1]);
+    __m128i bias2 = _mm_set1_epi32(edges->bias[2]);
+    __m128i minus_one = _mm_set1_epi32(-1);
+    __m128i dx_block = _mm_add_epi32(_mm_set1_epi32(x - attributes->origin_x), _mm_setr_epi32(0, 1, 2, 3));
+    __m128i dx_step = _mm_set1_epi32(4);
+    __m128 reciprocal_w_row = _mm_set1_ps(plane_row_value(&attributes->reciprocal_w, y - attributes->origin_y));
+    __m128 reciprocal_w_dx = _mm_set1_ps(attributes->reciprocal_w.d_dx);
+    __m128 one = _mm_set1_ps(1.0);
+    __m128 color = _mm_castsi128_ps(_mm_set1_epi32(attributes->color));
 
-    if (y2 - y1 != 0)
+    for (; x + 3 <= x_end; x += 4)
     {
-        for (int y = y1; y <= y2; y++)
+        __m128i edge_or = _mm_or_si128(_mm_add_epi32(e0_block, bias0), _mm_or_si128(_mm_add_epi32(e1_block, bias1), _mm_add_epi32(e2_block, bias2)));
+        __m128 inside = _mm_castsi128_ps(_mm_cmpgt_epi32(edge_or, minus_one));
+        if (_mm_movemask_ps(inside) != 0)
         {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+            __m128 depth = _mm_sub_ps(one, _mm_add_ps(reciprocal_w_row, _mm_mul_ps(_mm_cvtepi32_ps(dx_block), reciprocal_w_dx)));
 
-            if (x_end < x_start)
+            // SSE2 has no blend instruction, select with and/andnot/or
+            __m128 old_depth = _mm_loadu_ps(&z_row[x]);
+            __m128 pass = _mm_and_ps(inside, depth_test_sse2(depth, old_depth, attributes->depth_equal));
+            wrote |= _mm_movemask_ps(pass) != 0;
+            _mm_storeu_ps(&z_row[x], _mm_or_ps(_mm_and_ps(pass, attributes->depth_equal ? _mm_set1_ps(SHADED_DEPTH) : depth), _mm_andnot_ps(pass, old_depth)));
+            __m128 old_color = _mm_loadu_ps((float *)&color_row[x]);
+            _mm_storeu_ps((float *)&color_row[x], _mm_or_ps(_mm_and_ps(pass, color), _mm_andnot_ps(pass, old_color)));
+        }
+        e0_block = _mm_add_epi32(e0_block, e0_step);
+        e1_block = _mm_add_epi32(e1_block, e1_step);
+        e2_block = _mm_add_epi32(e2_block, e2_step);
+        dx_block = _mm_add_epi32(dx_block, dx_step);
+    }
+
+    // The pixels left after the last whole block
+    int skipped = x - x_start;
+    int e_left[3] = {e[0] + skipped * edges->step_x[0], e[1] + skipped * edges->step_x[1], e[2] + skipped * edges->step_x[2]};
+    return draw_flat_row_scalar(edges, y, x, x_end, e_left, attributes, color_row, z_row) || wrote;
+}
+#endif
+
+// Also finishes the rows of the SIMD kernels, from x to x_end with the edge values e at x
+static bool draw_textured_row_scalar(const triangle_edges_t *edges, int y, int x, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    int e0 = e[0];
+    int e1 = e[1];
+    int e2 = e[2];
+    int dy = y - attributes->origin_y;
+    float reciprocal_w_row = plane_row_value(&attributes->reciprocal_w, dy);
+    float u_over_w_row = plane_row_value(&attributes->u_over_w, dy);
+    float v_over_w_row = plane_row_value(&attributes->v_over_w, dy);
+    bool wrote = false;
+    for (; x <= x_end; x++)
+    {
+        // Inside when no biased edge value is negative
+        if (((e0 + edges->bias[0]) | (e1 + edges->bias[1]) | (e2 + edges->bias[2])) >= 0)
+        {
+            int dx = x - attributes->origin_x;
+            float interpolated_reciprocal_w = plane_value(reciprocal_w_row, &attributes->reciprocal_w, dx);
+
+            // Adjust 1/w so the pixel that are closer to the viewer have smaller values (bcs 1/2 > 1/3)
+            float depth = 1.0 - interpolated_reciprocal_w;
+
+            // Only draw the pixel if the depth value is less than the one previous stored in the zbuffer
+            if (pass_depth_test(depth, z_row[x], attributes->depth_equal))
             {
-                int_swap(&x_start, &x_end);
+                // now we can divide back the interpolated U/w and V/w by 1/w, with a single division
+                float w = 1 / interpolated_reciprocal_w;
+                float interpolated_u = plane_value(u_over_w_row, &attributes->u_over_w, dx) * w;
+                float interpolated_v = plane_value(v_over_w_row, &attributes->v_over_w, dx) * w;
+                float footprint = attributes->texture_filter != TEXTURE_FILTER_NEAREST ? texel_footprint(attributes, interpolated_u, interpolated_v, w) : 0;
+
+                color_row[x] = sample_texture(attributes, interpolated_u, interpolated_v, footprint);
+                z_row[x] = attributes->depth_equal ? SHADED_DEPTH : depth;
+                wrote = true;
             }
+        }
+        e0 += edges->step_x[0];
+        e1 += edges->step_x[1];
+        e2 += edges->step_x[2];
+    }
+    return wrote;
+}
 
-            for (int x = x_start; x < x_end; x++)
+#if defined(CPU_X86)
+CPU_TARGET("avx2")
+static bool draw_textured_row_avx2(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    int x = x_start;
+    int e0 = e[0];
+    int e1 = e[1];
+    int e2 = e[2];
+    int dy = y - attributes->origin_y;
+    bool wrote = false;
+
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i e0_block = _mm256_add_epi32(_mm256_set1_epi32(e0), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[0])));
+    __m256i e1_block = _mm256_add_epi32(_mm256_set1_epi32(e1), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[1])));
+    __m256i e2_block = _mm256_add_epi32(_mm256_set1_epi32(e2), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[2])));
+    __m256i e0_step = _mm256_set1_epi32(edges->step_x[0] * 8);
+    __m256i e1_step = _mm256_set1_epi32(edges->step_x[1] * 8);
+    __m256i e2_step = _mm256_set1_epi32(edges->step_x[2] * 8);
+    __m256i bias0 = _mm256_set1_epi32(edges->bias[0]);
+    __m256i bias1 = _mm256_set1_epi32(edges->bias[1]);
+    __m256i bias2 = _mm256_set1_epi32(edges->bias[2]);
+    __m256i minus_one = _mm256_set1_epi32(-1);
+    __m256i dx_block = _mm256_add_epi32(_mm256_set1_epi32(x - attributes->origin_x), lanes);
+    __m256i dx_step = _mm256_set1_epi32(8);
+    __m256 reciprocal_w_row = _mm256_set1_ps(plane_row_value(&attributes->reciprocal_w, dy));
+    __m256 reciprocal_w_dx = _mm256_set1_ps(attributes->reciprocal_w.d_dx);
+    __m256 reciprocal_w_dy = _mm256_set1_ps(attributes->reciprocal_w.d_dy);
+    __m256 u_row = _mm256_set1_ps(plane_row_value(&attributes->u_over_w, dy));
+    __m256 u_dx = _mm256_set1_ps(attributes->u_over_w.d_dx);
+    __m256 u_dy = _mm256_set1_ps(attributes->u_over_w.d_dy);
+    __m256 v_row = _mm256_set1_ps(plane_row_value(&attributes->v_over_w, dy));
+    __m256 v_dx = _mm256_set1_ps(attributes->v_over_w.d_dx);
+    __m256 v_dy = _mm256_set1_ps(attributes->v_over_w.d_dy);
+    __m256 texture_width = _mm256_set1_ps(attributes->texture_width);
+    __m256 texture_height = _mm256_set1_ps(attributes->texture_height);
+    __m256 one = _mm256_set1_ps(1.0);
+    bool mipmapped = attributes->texture_filter != TEXTURE_FILTER_NEAREST;
+
+    for (; x + 7 <= x_end; x += 8)
+    {
+        __m256i edge_or = _mm256_or_si256(_mm256_add_epi32(e0_block, bias0), _mm256_or_si256(_mm256_add_epi32(e1_block, bias1), _mm256_add_epi32(e2_block, bias2)));
+        __m256 inside = _mm256_castsi256_ps(_mm256_cmpgt_epi32(edge_or, minus_one));
+        if (_mm256_movemask_ps(inside) != 0)
+        {
+            __m256 dx = _mm256_cvtepi32_ps(dx_block);
+            __m256 reciprocal_w = _mm256_add_ps(reciprocal_w_row, _mm256_mul_ps(dx, reciprocal_w_dx));
+            __m256 depth = _mm256_sub_ps(one, reciprocal_w);
+
+            __m256 old_depth = _mm256_loadu_ps(&z_row[x]);
+            __m256 pass = _mm256_and_ps(inside, depth_test_avx2(depth, old_depth, attributes->depth_equal));
+            int pass_mask = _mm256_movemask_ps(pass);
+            if (pass_mask != 0)
             {
-                // Draw our pixel with the color that comes from the texture
-                draw_triangle_pixel(x, y, point_a, point_b, point_c, color);
+                wrote = true;
+                __m256 w = _mm256_div_ps(one, reciprocal_w);
+                __m256 u = _mm256_mul_ps(_mm256_add_ps(u_row, _mm256_mul_ps(dx, u_dx)), w);
+                __m256 v = _mm256_mul_ps(_mm256_add_ps(v_row, _mm256_mul_ps(dx, v_dx)), w);
+                __m256 footprint = _mm256_setzero_ps();
+                if (mipmapped)
+                {
+                    __m256 du_dx = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(u_dx, _mm256_mul_ps(u, reciprocal_w_dx)), w), texture_width);
+                    __m256 dv_dx = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(v_dx, _mm256_mul_ps(v, reciprocal_w_dx)), w), texture_height);
+                    __m256 du_dy = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(u_dy, _mm256_mul_ps(u, reciprocal_w_dy)), w), texture_width);
+                    __m256 dv_dy = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(v_dy, _mm256_mul_ps(v, reciprocal_w_dy)), w), texture_height);
+                    footprint = _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(du_dx, du_dx), _mm256_mul_ps(dv_dx, dv_dx)), _mm256_add_ps(_mm256_mul_ps(du_dy, du_dy), _mm256_mul_ps(dv_dy, dv_dy)));
+                }
+                float lane_u[8];
+                float lane_v[8];
+                float lane_footprint[8];
+                _mm256_storeu_ps(lane_u, u);
+                _mm256_storeu_ps(lane_v, v);
+                _mm256_storeu_ps(lane_footprint, footprint);
+
+                // The texel fetches are done lane by lane, only for the pixels that pass
+                uint32_t texels[8];
+                for (int i = 0; i < 8; i++)
+                {
+                    texels[i] = (pass_mask >> i) & 1 ? sample_texture(attributes, lane_u[i], lane_v[i], lane_footprint[i]) : 0;
+                }
+
+                _mm256_storeu_ps(&z_row[x], _mm256_blendv_ps(old_depth, attributes->depth_equal ? _mm256_set1_ps(SHADED_DEPTH) : depth, pass));
+                __m256i old_color = _mm256_loadu_si256((__m256i *)&color_row[x]);
+                __m256i new_color = _mm256_loadu_si256((__m256i *)texels);
+                _mm256_storeu_si256((__m256i *)&color_row[x], _mm256_blendv_epi8(old_color, new_color, _mm256_castps_si256(pass)));
             }
         }
+        e0_block = _mm256_add_epi32(e0_block, e0_step);
+        e1_block = _mm256_add_epi32(e1_block, e1_step);
+        e2_block = _mm256_add_epi32(e2_block, e2_step);
+        dx_block = _mm256_add_epi32(dx_block, dx_step);
     }
+
+    // The pixels left after the last whole block
+    int skipped = x - x_start;
+    int e_left[3] = {e[0] + skipped * edges->step_x[0], e[1] + skipped * edges->step_x[1], e[2] + skipped * edges->step_x[2]};
+    return draw_textured_row_scalar(edges, y, x, x_end, e_left, attributes, color_row, z_row) || wrote;
 }
 
-// Returns the barycentric weights alpha,beta,gamma for a point p
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p)
+CPU_TARGET("sse2")
+static bool draw_textured_row_sse2(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
 {
+    int x = x_start;
+    int e0 = e[0];
+    int e1 = e[1];
+    int e2 = e[2];
+    int dy = y - attributes->origin_y;
+    bool wrote = false;
 
-    vec2_t ac = vec2_sub(c, a);
-    vec2_t ab = vec2_sub(b, a);
-    vec2_t ap = vec2_sub(p, a);
-    vec2_t pc = vec2_sub(c, p);
-    vec2_t pb = vec2_sub(b, p);
+    __m128i e0_block = _mm_setr_epi32(e0, e0 + edges->step_x[0], e0 + edges->step_x[0] * 2, e0 + edges->step_x[0] * 3);
+    __m128i e1_block = _mm_setr_epi32(e1, e1 + edges->step_x[1], e1 + edges->step_x[1] * 2, e1 + edges->step_x[1] * 3);
+    __m128i e2_block = _mm_setr_epi32(e2, e2 + edges->step_x[2], e2 + edges->step_x[2] * 2, e2 + edges->step_x[2] * 3);
+    __m128i e0_step = _mm_set1_epi32(edges->step_x[0] * 4);
+    __m128i e1_step = _mm_set1_epi32(edges->step_x[1] * 4);
+    __m128i e2_step = _mm_set1_epi32(edges->step_x[2] * 4);
+    __m128i bias0 = _mm_set1_epi32(edges->bias[0]);
+    __m128i bias1 = _mm_set1_epi32(edges->bias[1]);
+    __m128i bias2 = _mm_set1_epi32(edges->bias[2]);
+    __m128i minus_one = _mm_set1_epi32(-1);
+    __m128i dx_block = _mm_add_epi32(_mm_set1_epi32(x - attributes->origin_x), _mm_setr_epi32(0, 1, 2, 3));
+    __m128i dx_step = _mm_set1_epi32(4);
+    __m128 reciprocal_w_row = _mm_set1_ps(plane_row_value(&attributes->reciprocal_w, dy));
+    __m128 reciprocal_w_dx = _mm_set1_ps(attributes->reciprocal_w.d_dx);
+    __m128 reciprocal_w_dy = _mm_set1_ps(attributes->reciprocal_w.d_dy);
+    __m128 u_row = _mm_set1_ps(plane_row_value(&attributes->u_over_w, dy));
+    __m128 u_dx = _mm_set1_ps(attributes->u_over_w.d_dx);
+    __m128 u_dy = _mm_set1_ps(attributes->u_over_w.d_dy);
+    __m128 v_row = _mm_set1_ps(plane_row_value(&attributes->v_over_w, dy));
+    __m128 v_dx = _mm_set1_ps(attributes->v_over_w.d_dx);
+    __m128 v_dy = _mm_set1_ps(attributes->v_over_w.d_dy);
+    __m128 texture_width = _mm_set1_ps(attributes->texture_width);
+    __m128 texture_height = _mm_set1_ps(attributes->texture_height);
+    __m128 one = _mm_set1_ps(1.0);
+    bool mipmapped = attributes->texture_filter != TEXTURE_FILTER_NEAREST;
 
-    // remember the alpha = Area_parallelogram ABC(F) / Area_parallelogram ACP(E) ~ which is same as Area_triangle ABC / Area_triangle APC
-    // and we get the area of the parallelogram ABC(F) by using the cross product
-    float area_parallelogram_abc = (ac.x * ab.y - ac.y * ab.x);
+    for (; x + 3 <= x_end; x += 4)
+    {
+        __m128i edge_or = _mm_or_si128(_mm_add_epi32(e0_block, bias0), _mm_or_si128(_mm_add_epi32(e1_block, bias1), _mm_add_epi32(e2_block, bias2)));
+        __m128 inside = _mm_castsi128_ps(_mm_cmpgt_epi32(edge_or, minus_one));
+        if (_mm_movemask_ps(inside) != 0)
+        {
+            __m128 dx = _mm_cvtepi32_ps(dx_block);
+            __m128 reciprocal_w = _mm_add_ps(reciprocal_w_row, _mm_mul_ps(dx, reciprocal_w_dx));
+            __m128 depth = _mm_sub_ps(one, reciprocal_w);
 
-    float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parallelogram_abc;
-    float beta = (ac.x * ap.y - ac.y * ap.x) / area_parallelogram_abc;
-    float gamma = 1 - alpha - beta;
+            __m128 old_depth = _mm_loadu_ps(&z_row[x]);
+            __m128 pass = _mm_and_ps(inside, depth_test_sse2(depth, old_depth, attributes->depth_equal));
+            int pass_mask = _mm_movemask_ps(pass);
+            if (pass_mask != 0)
+            {
+                wrote = true;
+                __m128 w = _mm_div_ps(one, reciprocal_w);
+                __m128 u = _mm_mul_ps(_mm_add_ps(u_row, _mm_mul_ps(dx, u_dx)), w);
+                __m128 v = _mm_mul_ps(_mm_add_ps(v_row, _mm_mul_ps(dx, v_dx)), w);
+                __m128 footprint = _mm_setzero_ps();
+                if (mipmapped)
+                {
+                    __m128 du_dx = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(u_dx, _mm_mul_ps(u, reciprocal_w_dx)), w), texture_width);
+                    __m128 dv_dx = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(v_dx, _mm_mul_ps(v, reciprocal_w_dx)), w), texture_height);
+                    __m128 du_dy = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(u_dy, _mm_mul_ps(u, reciprocal_w_dy)), w), texture_width);
+                    __m128 dv_dy = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(v_dy, _mm_mul_ps(v, reciprocal_w_dy)), w), texture_height);
+                    footprint = _mm_max_ps(_mm_add_ps(_mm_mul_ps(du_dx, du_dx), _mm_mul_ps(dv_dx, dv_dx)), _mm_add_ps(_mm_mul_ps(du_dy, du_dy), _mm_mul_ps(dv_dy, dv_dy)));
+                }
+                float lane_u[4];
+                float lane_v[4];
+                float lane_footprint[4];
+                _mm_storeu_ps(lane_u, u);
+                _mm_storeu_ps(lane_v, v);
+                _mm_storeu_ps(lane_footprint, footprint);
 
-    vec3_t weights = {alpha, beta, gamma};
+                // The texel fetches are done lane by lane, only for the pixels that pass
+                uint32_t texels[4];
+                for (int i = 0; i < 4; i++)
+                {
+                    texels[i] = (pass_mask >> i) & 1 ? sample_texture(attributes, lane_u[i], lane_v[i], lane_footprint[i]) : 0;
+                }
 
-    return weights;
+                // SSE2 has no blend instruction, select with and/andnot/or
+                _mm_storeu_ps(&z_row[x], _mm_or_ps(_mm_and_ps(pass, attributes->depth_equal ? _mm_set1_ps(SHADED_DEPTH) : depth), _mm_andnot_ps(pass, old_depth)));
+                __m128 old_color = _mm_loadu_ps((float *)&color_row[x]);
+                __m128 new_color = _mm_loadu_ps((float *)texels);
+                _mm_storeu_ps((float *)&color_row[x], _mm_or_ps(_mm_and_ps(pass, new_color), _mm_andnot_ps(pass, old_color)));
+            }
+        }
+        e0_block = _mm_add_epi32(e0_block, e0_step);
+        e1_block = _mm_add_epi32(e1_block, e1_step);
+        e2_block = _mm_add_epi32(e2_block, e2_step);
+        dx_block = _mm_add_epi32(dx_block, dx_step);
+    }
+
+    // The pixels left after the last whole block
+    int skipped = x - x_start;
+    int e_left[3] = {e[0] + skipped * edges->step_x[0], e[1] + skipped * edges->step_x[1], e[2] + skipped * edges->step_x[2]};
+    return draw_textured_row_scalar(edges, y, x, x_end, e_left, attributes, color_row, z_row) || wrote;
 }
+#endif
 
-// Function to draw a zbuffered triangle
-void draw_triangle_pixel(int x, int y, vec4_t point_a, vec4_t point_b, vec4_t point_c, uint32_t color)
+// Depth only: 1/w is the only attribute interpolated, color_row is left alone
+static bool draw_depth_row_scalar(const triangle_edges_t *edges, int y, int x, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
 {
-    vec2_t point_p = {x, y};
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-    vec3_t weights = barycentric_weights(a, b, c, point_p);
+    int e0 = e[0];
+    int e1 = e[1];
+    int e2 = e[2];
+    float reciprocal_w_row = plane_row_value(&attributes->reciprocal_w, y - attributes->origin_y);
+    bool wrote = false;
+    for (; x <= x_end; x++)
+    {
+        // Inside when no biased edge value is negative
+        if (((e0 + edges->bias[0]) | (e1 + edges->bias[1]) | (e2 + edges->bias[2])) >= 0)
+        {
+            float depth = 1.0 - plane_value(reciprocal_w_row, &attributes->reciprocal_w, x - attributes->origin_x);
+            if (depth < z_row[x])
+            {
+                z_row[x] = depth;
+                wrote = true;
+            }
+        }
+        e0 += edges->step_x[0];
+        e1 += edges->step_x[1];
+        e2 += edges->step_x[2];
+    }
+    return wrote;
+}
+
+#if defined(CPU_X86)
+CPU_TARGET("avx2")
+static bool draw_depth_row_avx2(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    int x = x_start;
+    bool wrote = false;
+
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i e0_block = _mm256_add_epi32(_mm256_set1_epi32(e[0]), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[0])));
+    __m256i e1_block = _mm256_add_epi32(_mm256_set1_epi32(e[1]), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[1])));
+    __m256i e2_block = _mm256_add_epi32(_mm256_set1_epi32(e[2]), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(edges->step_x[2])));
+    __m256i e0_step = _mm256_set1_epi32(edges->step_x[0] * 8);
+    __m256i e1_step = _mm256_set1_epi32(edges->step_x[1] * 8);
+    __m256i e2_step = _mm256_set1_epi32(edges->step_x[2] * 8);
+    __m256i bias0 = _mm256_set1_epi32(edges->bias[0]);
+    __m256i bias1 = _mm256_set1_epi32(edges->bias[1]);
+    __m256i bias2 = _mm256_set1_epi32(edges->bias[2]);
+    __m256i minus_one = _mm256_set1_epi32(-1);
+    __m256i dx_block = _mm256_add_epi32(_mm256_set1_epi32(x - attributes->origin_x), lanes);
+    __m256i dx_step = _mm256_set1_epi32(8);
+    __m256 reciprocal_w_row = _mm256_set1_ps(plane_row_value(&attributes->reciprocal_w, y - attributes->origin_y));
+    __m256 reciprocal_w_dx = _mm256_set1_ps(attributes->reciprocal_w.d_dx);
+    __m256 one = _mm256_set1_ps(1.0);
 
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
+    for (; x + 7 <= x_end; x += 8)
+    {
+        __m256i edge_or = _mm256_or_si256(_mm256_add_epi32(e0_block, bias0), _mm256_or_si256(_mm256_add_epi32(e1_block, bias1), _mm256_add_epi32(e2_block, bias2)));
+        __m256 inside = _mm256_castsi256_ps(_mm256_cmpgt_epi32(edge_or, minus_one));
+        if (_mm256_movemask_ps(inside) != 0)
+        {
+            __m256 depth = _mm256_sub_ps(one, _mm256_add_ps(reciprocal_w_row, _mm256_mul_ps(_mm256_cvtepi32_ps(dx_block), reciprocal_w_dx)));
 
-    float interpolated_reciprocal_w; // 1/w
+            __m256 old_depth = _mm256_loadu_ps(&z_row[x]);
+            __m256 pass = _mm256_and_ps(inside, _mm256_cmp_ps(depth, old_depth, _CMP_LT_OQ));
+            wrote |= _mm256_movemask_ps(pass) != 0;
+            _mm256_storeu_ps(&z_row[x], _mm256_blendv_ps(old_depth, depth, pass));
+        }
+        e0_block = _mm256_add_epi32(e0_block, e0_step);
+        e1_block = _mm256_add_epi32(e1_block, e1_step);
+        e2_block = _mm256_add_epi32(e2_block, e2_step);
+        dx_block = _mm256_add_epi32(dx_block, dx_step);
+    }
 
-    interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
+    // The pixels left after the last whole block
+    int skipped = x - x_start;
+    int e_left[3] = {e[0] + skipped * edges->step_x[0], e[1] + skipped * edges->step_x[1], e[2] + skipped * edges->step_x[2]};
+    return draw_depth_row_scalar(edges, y, x, x_end, e_left, attributes, color_row, z_row) || wrote;
+}
+
+CPU_TARGET("sse2")
+static bool draw_depth_row_sse2(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    int x = x_start;
+    int e0 = e[0];
+    int e1 = e[1];
+    int e2 = e[2];
+    bool wrote = false;
 
-    // Adjust 1/w so the pixel that are closer to the viewer have smaller values (bcs 1/2 > 1/3)
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+    __m128i e0_block = _mm_setr_epi32(e0, e0 + edges->step_x[0], e0 + edges->step_x[0] * 2, e0 + edges->step_x[0] * 3);
+    __m128i e1_block = _mm_setr_epi32(e1, e1 + edges->step_x[1], e1 + edges->step_x[1] * 2, e1 + edges->step_x[1] * 3);
+    __m128i e2_block = _mm_setr_epi32(e2, e2 + edges->step_x[2], e2 + edges->step_x[2] * 2, e2 + edges->step_x[2] * 3);
+    __m128i e0_step = _mm_set1_epi32(edges->step_x[0] * 4);
+    __m128i e1_step = _mm_set1_epi32(edges->step_x[1] * 4);
+    __m128i e2_step = _mm_set1_epi32(edges->step_x[2] * 4);
+    __m128i bias0 = _mm_set1_epi32(edges->bias[0]);
+    __m128i bias1 = _mm_set1_epi32(edges->bias[1]);
+    __m128i bias2 = _mm_set1_epi32(edges->bias[2]);
+    __m128i minus_one = _mm_set1_epi32(-1);
+    __m128i dx_block = _mm_add_epi32(_mm_set1_epi32(x - attributes->origin_x), _mm_setr_epi32(0, 1, 2, 3));
+    __m128i dx_step = _mm_set1_epi32(4);
+    __m128 reciprocal_w_row = _mm_set1_ps(plane_row_value(&attributes->reciprocal_w, y - attributes->origin_y));
+    __m128 reciprocal_w_dx = _mm_set1_ps(attributes->reciprocal_w.d_dx);
+    __m128 one = _mm_set1_ps(1.0);
 
-    // Only draw the pixel if the depth value is less than the one previous stored in the zbuffer
-    if (interpolated_reciprocal_w < get_zbuffer_at(x, y))
+    for (; x + 3 <= x_end; x += 4)
     {
-        draw_pixel(x, y, color);
-        // Update the zbuffer value with the 1/w of this current pixel
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+        __m128i edge_or = _mm_or_si128(_mm_add_epi32(e0_block, bias0), _mm_or_si128(_mm_add_epi32(e1_block, bias1), _mm_add_epi32(e2_block, bias2)));
+        __m128 inside = _mm_castsi128_ps(_mm_cmpgt_epi32(edge_or, minus_one));
+        if (_mm_movemask_ps(inside) != 0)
+        {
+            __m128 depth = _mm_sub_ps(one, _mm_add_ps(reciprocal_w_row, _mm_mul_ps(_mm_cvtepi32_ps(dx_block), reciprocal_w_dx)));
+
+            // SSE2 has no blend instruction, select with and/andnot/or
+            __m128 old_depth = _mm_loadu_ps(&z_row[x]);
+            __m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(depth, old_depth));
+            wrote |= _mm_movemask_ps(pass) != 0;
+            _mm_storeu_ps(&z_row[x], _mm_or_ps(_mm_and_ps(pass, depth), _mm_andnot_ps(pass, old_depth)));
+        }
+        e0_block = _mm_add_epi32(e0_block, e0_step);
+        e1_block = _mm_add_epi32(e1_block, e1_step);
+        e2_block = _mm_add_epi32(e2_block, e2_step);
+        dx_block = _mm_add_epi32(dx_block, dx_step);
     }
+
+    // The pixels left after the last whole block
+    int skipped = x - x_start;
+    int e_left[3] = {e[0] + skipped * edges->step_x[0], e[1] + skipped * edges->step_x[1], e[2] + skipped * edges->step_x[2]};
+    return draw_depth_row_scalar(edges, y, x, x_end, e_left, attributes, color_row, z_row) || wrote;
 }
-// Function to draw the textured pixel at position x and y using interpolation
-void draw_texel(int x, int y,
-                vec4_t point_a, vec4_t point_b, vec4_t point_c,
-                tex2_t a_uv, tex2_t b_uv, tex2_t c_uv,
-                upng_t *texture)
+#endif
+
+static bool draw_flat_row(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
 {
-    vec2_t point_p = {x, y};
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-    vec3_t weights = barycentric_weights(a, b, c, point_p);
+    return draw_flat_row_scalar(edges, y, x_start, x_end, e, attributes, color_row, z_row);
+}
 
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
+static bool draw_textured_row(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    return draw_textured_row_scalar(edges, y, x_start, x_end, e, attributes, color_row, z_row);
+}
 
-    // Variables to store the interpolated values of u,v and 1/w for the current pixel
-    float interpolated_u;
-    float interpolated_v;
-    float interpolated_reciprocal_w; // 1/w
+static bool draw_depth_row(const triangle_edges_t *edges, int y, int x_start, int x_end, const int e[3], const triangle_attributes_t *attributes, uint32_t *color_row, float *z_row)
+{
+    return draw_depth_row_scalar(edges, y, x_start, x_end, e, attributes, color_row, z_row);
+}
 
-    // Perform the interpolation of all U/w and V/w values using barycentric weights and a factor of 1/w
-    interpolated_u = (a_uv.u / point_a.w) * alpha + (b_uv.u / point_b.w) * beta + (c_uv.u / point_c.w) * gamma;
-    interpolated_v = (a_uv.v / point_a.w) * alpha + (b_uv.v / point_b.w) * beta + (c_uv.v / point_c.w) * gamma;
+static row_kernel_t select_depth_row_kernel(void)
+{
+#if defined(CPU_X86)
+    if (get_cpu_path() >= CPU_PATH_AVX2)
+        return draw_depth_row_avx2;
+    if (get_cpu_path() >= CPU_PATH_SSE2)
+        return draw_depth_row_sse2;
+#endif
+    return draw_depth_row;
+}
 
-    interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
+static row_kernel_t select_flat_row_kernel(void)
+{
+#if defined(CPU_X86)
+    if (get_cpu_path() >= CPU_PATH_AVX2)
+        return draw_flat_row_avx2;
+    if (get_cpu_path() >= CPU_PATH_SSE2)
+        return draw_flat_row_sse2;
+#endif
+    return draw_flat_row;
+}
 
-    // now we can divide back both of those interpolated values by 1/w
-    interpolated_u /= interpolated_reciprocal_w;
-    interpolated_v /= interpolated_reciprocal_w;
+static row_kernel_t select_textured_row_kernel(void)
+{
+#if defined(CPU_X86)
+    if (get_cpu_path() >= CPU_PATH_AVX2)
+        return draw_textured_row_avx2;
+    if (get_cpu_path() >= CPU_PATH_SSE2)
+        return draw_textured_row_sse2;
+#endif
+    return draw_textured_row;
+}
 
-    int texture_width = upng_get_width(texture);
-    int texture_height = upng_get_height(texture);
-    // Map the UV coordinate to the full texture width and height
-    int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-    int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
+////////////////////////////////////////////////////////////////////////
+// Hierarchical depth test
+////////////////////////////////////////////////////////////////////////
+// The box of the triangle is walked in the blocks of the depth buffer. The
+// depth is linear in 1/w, so no pixel of the triangle is nearer than its
+// nearest vertex (give or take the rounding of the 1/w plane): a block whose
+// farthest depth is already nearer than that would reject every pixel, and
+// is skipped without running the kernel. The
+// blocks that are left are drawn as spans, and the farthest depth of the
+// blocks that got written is computed again once the span is done.
+////////////////////////////////////////////////////////////////////////
+
+// The kernels write their colors into target, the color buffer or the id buffer (NULL for depth only)
+static void rasterize_triangle(const triangle_edges_t *edges, const triangle_attributes_t *attributes, row_kernel_t draw_row, uint32_t *target)
+{
+    float *z_buffer = get_z_buffer();
+    int width = get_window_width();
+    float *z_block_max = get_z_block_max();
+    int z_blocks_per_row = get_z_blocks_per_row();
+
+    float nearest_depth = attributes->nearest_depth;
+
+    int first_block_x = edges->min_x / Z_BLOCK_SIZE;
+    int last_block_x = edges->max_x / Z_BLOCK_SIZE;
+    for (int block_y = edges->min_y / Z_BLOCK_SIZE; block_y <= edges->max_y / Z_BLOCK_SIZE; block_y++)
+    {
+        int y_start = block_y * Z_BLOCK_SIZE > edges->min_y ? block_y * Z_BLOCK_SIZE : edges->min_y;
+        int y_end = block_y * Z_BLOCK_SIZE + Z_BLOCK_SIZE - 1 < edges->max_y ? block_y * Z_BLOCK_SIZE + Z_BLOCK_SIZE - 1 : edges->max_y;
+
+        float *block_max_row = &z_block_max[block_y * z_blocks_per_row];
+        int block_x = first_block_x;
+        while (block_x <= last_block_x)
+        {
+            if (nearest_depth >= block_max_row[block_x])
+            {
+                block_x++;
+                continue;
+            }
+
+            // Draw the run of blocks the triangle may be visible in as one span
+            int span_first_block = block_x;
+            while (block_x <= last_block_x && nearest_depth < block_max_row[block_x])
+            {
+                block_x++;
+            }
+            int x_start = span_first_block * Z_BLOCK_SIZE > edges->min_x ? span_first_block * Z_BLOCK_SIZE : edges->min_x;
+            int x_end = block_x * Z_BLOCK_SIZE - 1 < edges->max_x ? block_x * Z_BLOCK_SIZE - 1 : edges->max_x;
 
-    // Adjust 1/w so the pixel that are closer to the viewer have smaller values (bcs 1/2 > 1/3)
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+            bool wrote = false;
+            for (int y = y_start; y <= y_end; y++)
+            {
+                int dx = x_start - edges->min_x;
+                int dy = y - edges->min_y;
+                int e[3] = {
+                    edges->start[0] + dx * edges->step_x[0] + dy * edges->step_y[0],
+                    edges->start[1] + dx * edges->step_x[1] + dy * edges->step_y[1],
+                    edges->start[2] + dx * edges->step_x[2] + dy * edges->step_y[2]};
+                wrote |= draw_row(edges, y, x_start, x_end, e, attributes, target != NULL ? &target[y * width] : NULL, &z_buffer[y * width]);
+            }
+
+            if (wrote)
+            {
+                for (int i = span_first_block; i < block_x; i++)
+                {
+                    update_z_block_max(i, block_y);
+                }
+            }
+        }
+    }
+}
+
+// Flat triangle into the color buffer (with its color) or the id buffer (with its id), only depth without a target
+static void draw_flat_triangle(int x0, int y0, float w0, int x1, int y1, float w1, int x2, int y2, float w2,
+                               uint32_t value, rect_t clip, uint32_t *target)
+{
+    if (is_clockwise(x0, y0, x1, y1, x2, y2))
+    {
+        int_swap(&x1, &x2);
+        int_swap(&y1, &y2);
+        float_swap(&w1, &w2);
+    }
 
-    // Only draw the pixel if the depth value is less than the one previous stored in the zbuffer
-    if (interpolated_reciprocal_w < get_zbuffer_at(x, y))
+    int x[3] = {x0, x1, x2};
+    int y[3] = {y0, y1, y2};
+    triangle_edges_t edges;
+    if (!setup_triangle_edges(x, y, clip, &edges))
     {
-        uint32_t *texture_buffer = (uint32_t *)upng_get_buffer(texture);
-        draw_pixel(x, y, texture_buffer[(texture_width * tex_y) + tex_x]);
-        // Update the zbuffer value with the 1/w of this current pixel
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+        return;
     }
+
+    float reciprocal_w[3] = {1 / w0, 1 / w1, 1 / w2};
+    triangle_attributes_t attributes = {
+        .color = value,
+        .depth_equal = depth_test == DEPTH_TEST_EQUAL};
+    setup_depth_plane(x, y, reciprocal_w, &attributes);
+
+    rasterize_triangle(&edges, &attributes, target != NULL ? select_flat_row_kernel() : select_depth_row_kernel(), target);
 }
 
-// Draw a textured triangle with a flat-top/flat bottom method
-void draw_textured_triangle(
-    int x0, int y0, float z0, float w0, float u0, float v0,
-    int x1, int y1, float z1, float w1, float u1, float v1,
-    int x2, int y2, float z2, float w2, float u2, float v2,
-    upng_t *texture)
+void draw_filled_triangle(int x0, int y0, float z0, float w0,
+                          int x1, int y1, float z1, float w1,
+                          int x2, int y2, float z2, float w2,
+                          uint32_t color, rect_t clip)
+{
+    draw_flat_triangle(x0, y0, w0, x1, y1, w1, x2, y2, w2, color, clip, get_color_buffer());
+}
+
+// Depth pre-pass, and the depth maps that need no color at all
+void draw_triangle_depth(int x0, int y0, float z0, float w0,
+                         int x1, int y1, float z1, float w1,
+                         int x2, int y2, float z2, float w2,
+                         rect_t clip)
+{
+    draw_flat_triangle(x0, y0, w0, x1, y1, w1, x2, y2, w2, 0, clip, NULL);
+}
+
+// Only the depth and the id are written, the visibility buffer is shaded once all the triangles are in
+void draw_triangle_id(int x0, int y0, float z0, float w0,
+                      int x1, int y1, float z1, float w1,
+                      int x2, int y2, float z2, float w2,
+                      uint32_t id, rect_t clip)
 {
+    draw_flat_triangle(x0, y0, w0, x1, y1, w1, x2, y2, w2, id, clip, get_id_buffer());
+}
 
-    // We need to sort the vertices by their y coordinate ascending (y0 < y1 < y2)
-    if (y0 > y1)
+// Edges and attributes of a textured triangle in screen space, false when it covers no pixel of the clip rect
+static bool setup_textured_triangle(const triangle_t *triangle, rect_t clip, triangle_edges_t *edges, triangle_attributes_t *attributes)
+{
+    // Vertex 1 and 2 are swapped for clockwise triangles
+    int order[3] = {0, 1, 2};
+    int x[3], y[3];
+    for (int i = 0; i < 3; i++)
     {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
+        x[i] = triangle->points[i].x;
+        y[i] = triangle->points[i].y;
     }
-    if (y1 > y2)
+    if (is_clockwise(x[0], y[0], x[1], y[1], x[2], y[2]))
     {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-        float_swap(&u1, &u2);
-        float_swap(&v1, &v2);
+        int_swap(&x[1], &x[2]);
+        int_swap(&y[1], &y[2]);
+        int_swap(&order[1], &order[2]);
     }
-    if (y0 > y1)
+    if (!setup_triangle_edges(x, y, clip, edges))
     {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
+        return false;
     }
-    // Flip the V component to account for inverted UV-Coordinate (in our system it grows downwards)
-    v0 = 1.0 - v0;
-    v1 = 1.0 - v1;
-    v2 = 1.0 - v2;
-
-    // Create vector points after we sort the vertices
-    vec4_t point_a = {x0, y0, z0, w0};
-    vec4_t point_b = {x1, y1, z1, w1};
-    vec4_t point_c = {x2, y2, z2, w2};
-
-    tex2_t a_uv = {u0, v0};
-    tex2_t b_uv = {u1, v1};
-    tex2_t c_uv = {u2, v2};
-    // Render the upper part of the triangle (flat-bottom)
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
-
-    if (y1 - y0 != 0)
-        inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-    if (y2 - y0 != 0)
-        inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-    if (y1 - y0 != 0)
+
+    // U/w, V/w and 1/w of the vertices are linear in screen space, divide them once per triangle
+    attributes->texture = triangle->texture;
+    attributes->texture_width = triangle->texture->width;
+    attributes->texture_height = triangle->texture->height;
+    attributes->texture_filter = get_texture_filter();
+    attributes->depth_equal = depth_test == DEPTH_TEST_EQUAL;
+    float reciprocal_w[3], u_over_w[3], v_over_w[3];
+    for (int i = 0; i < 3; i++)
     {
-        for (int y = y0; y <= y1; y++)
-        {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+        const vec4_t *point = &triangle->points[order[i]];
+        const tex2_t *texcoord = &triangle->texcoords[order[i]];
 
-            if (x_end < x_start)
-            {
-                int_swap(&x_start, &x_end);
-            }
+        // Flip the V component to account for inverted UV-Coordinate (in our system it grows downwards)
+        float v = 1.0 - texcoord->v;
 
-            for (int x = x_start; x < x_end; x++)
-            {
-                // Draw our pixel with the color that comes from the texture
-                draw_texel(x, y, point_a, point_b, point_c,
-                           a_uv, b_uv, c_uv,
-                           texture);
-            }
-        }
+        reciprocal_w[i] = 1 / point->w;
+        u_over_w[i] = texcoord->u * reciprocal_w[i];
+        v_over_w[i] = v * reciprocal_w[i];
     }
+    setup_depth_plane(x, y, reciprocal_w, attributes);
+    setup_attribute_plane(x, y, u_over_w, &attributes->u_over_w);
+    setup_attribute_plane(x, y, v_over_w, &attributes->v_over_w);
+    return true;
+}
 
-    // Render the bottom part of the triangle (flat-top)
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
+// Draw a textured triangle with perspective correct texture coordinates
+void draw_textured_triangle(
+    int x0, int y0, float z0, float w0, float u0, float v0,
+    int x1, int y1, float z1, float w1, float u1, float v1,
+    int x2, int y2, float z2, float w2, float u2, float v2,
+    texture_t *texture, rect_t clip)
+{
+    triangle_t triangle = {
+        .points = {{x0, y0, z0, w0}, {x1, y1, z1, w1}, {x2, y2, z2, w2}},
+        .texcoords = {{u0, v0}, {u1, v1}, {u2, v2}},
+        .texture = texture};
+
+    triangle_edges_t edges;
+    triangle_attributes_t attributes;
+    if (!setup_textured_triangle(&triangle, clip, &edges, &attributes))
+    {
+        return;
+    }
+    rasterize_triangle(&edges, &attributes, select_textured_row_kernel(), get_color_buffer());
+}
+
+////////////////////////////////////////////////////////////////////////
+// Visibility buffer shading
+////////////////////////////////////////////////////////////////////////
+// The raster pass leaves the id of the nearest triangle in every pixel.
+// Each pixel is then shaded once, with the same attribute planes as the
+// textured kernels, so the image is the one the
+// textured mode draws while the texture is only sampled for the pixels that
+// end up on screen. Neighbour pixels mostly share a triangle, its setup is
+// kept until the id changes.
+////////////////////////////////////////////////////////////////////////
+void shade_visibility_buffer(const triangle_t *triangles, rect_t rect)
+{
+    uint32_t *color_buffer = get_color_buffer();
+    uint32_t *id_buffer = get_id_buffer();
+    int width = get_window_width();
+    rect_t screen = get_screen_rect();
 
-    if (y2 - y1 != 0)
-        inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-    if (y2 - y0 != 0)
-        inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+    uint32_t current_id = NO_TRIANGLE_ID;
+    triangle_edges_t edges;
+    triangle_attributes_t attributes;
 
-    if (y2 - y1 != 0)
+    for (int y = rect.y_min; y < rect.y_max; y++)
     {
-        for (int y = y1; y <= y2; y++)
+        for (int x = rect.x_min; x < rect.x_max; x++)
         {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
-
-            if (x_end < x_start)
+            uint32_t id = id_buffer[(y * width) + x];
+            if (id == NO_TRIANGLE_ID)
             {
-                int_swap(&x_start, &x_end);
+                continue;
             }
-
-            for (int x = x_start; x < x_end; x++)
+            if (id != current_id)
             {
-                // Draw our pixel with the color that comes from the texture
-                draw_texel(x, y, point_a, point_b, point_c,
-                           a_uv, b_uv, c_uv,
-                           texture);
+                // The planes do not depend on the clip rect, the whole screen is as good as the tile
+                setup_textured_triangle(&triangles[id - 1], screen, &edges, &attributes);
+                current_id = id;
             }
+
+            int dx = x - attributes.origin_x;
+            int dy = y - attributes.origin_y;
+            float interpolated_reciprocal_w = plane_value(plane_row_value(&attributes.reciprocal_w, dy), &attributes.reciprocal_w, dx);
+            float w = 1 / interpolated_reciprocal_w;
+            float interpolated_u = plane_value(plane_row_value(&attributes.u_over_w, dy), &attributes.u_over_w, dx) * w;
+            float interpolated_v = plane_value(plane_row_value(&attributes.v_over_w, dy), &attributes.v_over_w, dx) * w;
+            float footprint = attributes.texture_filter != TEXTURE_FILTER_NEAREST ? texel_footprint(&attributes, interpolated_u, interpolated_v, w) : 0;
+            color_buffer[(y * width) + x] = sample_texture(&attributes, interpolated_u, interpolated_v, footprint);
         }
     }
-}
\ No newline at end of file
+}
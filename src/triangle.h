@@ -3,7 +3,7 @@
 #include "vector.h"
 #include <stdint.h>
 #include "texture.h"
-#include "upng.h"
+#include "display.h"
 
 typedef struct
 {
@@ -12,22 +12,34 @@ typedef struct
     uint32_t color;
 } face_t;
 
+// Depth comparison of the filled and textured triangles, EQUAL draws only the surfaces a depth pre-pass kept
+typedef enum
+{
+    DEPTH_TEST_LESS,
+    DEPTH_TEST_EQUAL
+} depth_test_t;
+
 typedef struct
 {
     vec4_t points[3];
     tex2_t texcoords[3];
     uint32_t color;
-    upng_t* texture;
+    texture_t* texture;
+    uint64_t sort_key; // Position in the draw order when the triangles are sorted
 } triangle_t;
 
-void draw_filled_triangle(int x0, int y0, float z0, float w0, int x1, int y1, float z1, float w1, int x2, int y2, float z2, float w2, uint32_t color);
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+void draw_filled_triangle(int x0, int y0, float z0, float w0, int x1, int y1, float z1, float w1, int x2, int y2, float z2, float w2, uint32_t color, rect_t clip);
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color, rect_t clip);
 void draw_textured_triangle(
     int x0, int y0 ,float z0, float w0, float u0, float v0,
     int x1, int y1 ,float z1, float w1, float u1, float v1,
     int x2, int y2 ,float z2, float w2, float u2, float v2,
-    upng_t *texture);
+    texture_t *texture, rect_t clip);
+void draw_triangle_depth(int x0, int y0, float z0, float w0, int x1, int y1, float z1, float w1, int x2, int y2, float z2, float w2, rect_t clip);
+void draw_triangle_id(int x0, int y0, float z0, float w0, int x1, int y1, float z1, float w1, int x2, int y2, float z2, float w2, uint32_t id, rect_t clip);
+void shade_visibility_buffer(const triangle_t *triangles, rect_t rect);
+
+void set_depth_test(depth_test_t test);
+depth_test_t get_depth_test(void);
 
-void draw_texel(int x, int y, vec4_t point_a, vec4_t point_b, vec4_t point_c, tex2_t a_uv, tex2_t b_uv, tex2_t c_uv, upng_t *texture);
-void draw_triangle_pixel(int x, int y, vec4_t point_a, vec4_t point_b, vec4_t point_c, uint32_t color);
 vec3_t get_triangle_normal(vec4_t vertices[3]);
\ No newline at end of file
@@ -30,6 +30,11 @@ freely, subject to the following restrictions:
 #include <limits.h>
 
 #include "upng.h"
+#include "cpu.h"
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#endif
 
 #define MAKE_BYTE(b) ((b) & 0xFF)
 #define MAKE_DWORD(a,b,c,d) ((MAKE_BYTE(a) << 24) | (MAKE_BYTE(b) << 16) | (MAKE_BYTE(c) << 8) | MAKE_BYTE(d))
@@ -688,6 +693,63 @@ static int paeth_predictor(int a, int b, int c)
 		return c;
 }
 
+#if defined(CPU_X86)
+/*
+   SIMD versions of the Up filter (every byte adds the byte above it) and of the Sub filter for
+   4 byte pixels (every pixel adds the pixel on its left). Average and Paeth depend on the pixel
+   just reconstructed in a way that does not vectorize, and inflate reads the stream bit by bit,
+   so those stay scalar.
+ */
+CPU_TARGET("sse2")
+static void unfilter_up_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	unsigned long i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i current = _mm_loadu_si128((const __m128i *)&scanline[i]);
+		__m128i above = _mm_loadu_si128((const __m128i *)&precon[i]);
+		_mm_storeu_si128((__m128i *)&recon[i], _mm_add_epi8(current, above));
+	}
+	for (; i < length; i++)
+		recon[i] = scanline[i] + precon[i];
+}
+
+CPU_TARGET("avx2")
+static void unfilter_up_avx2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	unsigned long i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i current = _mm256_loadu_si256((const __m256i *)&scanline[i]);
+		__m256i above = _mm256_loadu_si256((const __m256i *)&precon[i]);
+		_mm256_storeu_si256((__m256i *)&recon[i], _mm256_add_epi8(current, above));
+	}
+	for (; i < length; i++)
+		recon[i] = scanline[i] + precon[i];
+}
+
+/* prefix sum of 4 pixels at a time: add the block shifted by one pixel, then by two, then the last pixel of the previous block */
+CPU_TARGET("sse2")
+static void unfilter_sub4_sse2(unsigned char *recon, const unsigned char *scanline, unsigned long length)
+{
+	unsigned long i;
+	int left_pixel;
+	for (i = 0; i < 4; i++)
+		recon[i] = scanline[i];
+	memcpy(&left_pixel, recon, 4);
+	__m128i left = _mm_set1_epi32(left_pixel);
+
+	for (i = 4; i + 16 <= length; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)&scanline[i]);
+		block = _mm_add_epi8(block, _mm_slli_si128(block, 4));
+		block = _mm_add_epi8(block, _mm_slli_si128(block, 8));
+		block = _mm_add_epi8(block, left);
+		_mm_storeu_si128((__m128i *)&recon[i], block);
+		left = _mm_shuffle_epi32(block, 0xFF);
+	}
+	for (; i < length; i++)
+		recon[i] = scanline[i] + recon[i - 4];
+}
+#endif
+
 static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length)
 {
 	/*
@@ -705,12 +767,28 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 			recon[i] = scanline[i];
 		break;
 	case 1:
+#if defined(CPU_X86)
+		if (bytewidth == 4 && length >= 4 && get_cpu_path() >= CPU_PATH_SSE2) {
+			unfilter_sub4_sse2(recon, scanline, length);
+			break;
+		}
+#endif
 		for (i = 0; i < bytewidth; i++)
 			recon[i] = scanline[i];
 		for (i = bytewidth; i < length; i++)
 			recon[i] = scanline[i] + recon[i - bytewidth];
 		break;
 	case 2:
+#if defined(CPU_X86)
+		if (precon && get_cpu_path() >= CPU_PATH_AVX2) {
+			unfilter_up_avx2(recon, scanline, precon, length);
+			break;
+		}
+		if (precon && get_cpu_path() >= CPU_PATH_SSE2) {
+			unfilter_up_sse2(recon, scanline, precon, length);
+			break;
+		}
+#endif
 		if (precon)
 			for (i = 0; i < length; i++)
 				recon[i] = scanline[i] + precon[i];
@@ -1,5 +1,7 @@
 #include "vector.h"
 #include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 ////////////////////////////////////////////////////////////////////////
 // Vec2D Functions
@@ -184,4 +186,46 @@ vec4_t vec4_from_vec3(vec3_t v)
 {
     vec4_t result = {v.x, v.y, v.z, 1.0};
     return result;
-}
\ No newline at end of file
+}
+
+////////////////////////////////////////////////////////////////////////
+// Vec3 SoA
+////////////////////////////////////////////////////////////////////////
+
+vec3_soa_t vec3_soa_from_array(vec3_t *vertices, int count)
+{
+    vec3_soa_t soa = {0};
+    soa.count = count;
+    soa.padded_count = (count + VEC3_SOA_WIDTH - 1) / VEC3_SOA_WIDTH * VEC3_SOA_WIDTH;
+
+    // One block holds the three component arrays, with some slack to align the start
+    size_t lane_bytes = sizeof(float) * soa.padded_count;
+    soa.memory = calloc(1, lane_bytes * 3 + VEC3_SOA_ALIGNMENT);
+    if (soa.memory == NULL)
+    {
+        return soa;
+    }
+    uintptr_t aligned = ((uintptr_t)soa.memory + VEC3_SOA_ALIGNMENT - 1) & ~(uintptr_t)(VEC3_SOA_ALIGNMENT - 1);
+
+    // lane_bytes is a multiple of VEC3_SOA_WIDTH floats, so y and z stay aligned too
+    soa.x = (float *)aligned;
+    soa.y = (float *)(aligned + lane_bytes);
+    soa.z = (float *)(aligned + lane_bytes * 2);
+
+    // The padding lanes stay zeroed by calloc
+    for (int i = 0; i < count; i++)
+    {
+        soa.x[i] = vertices[i].x;
+        soa.y[i] = vertices[i].y;
+        soa.z[i] = vertices[i].z;
+    }
+    return soa;
+}
+
+void vec3_soa_free(vec3_soa_t *soa)
+{
+    free(soa->memory);
+    soa->memory = NULL;
+    soa->x = soa->y = soa->z = NULL;
+    soa->count = soa->padded_count = 0;
+}
@@ -21,6 +21,24 @@ typedef struct
     float w;
 } vec4_t;
 
+////////////////////////////////////////////////////////////////////////
+// Structure of arrays storage of vec3 positions for SIMD processing
+// Each component array is padded to a multiple of VEC3_SOA_WIDTH and
+// aligned to VEC3_SOA_ALIGNMENT bytes so full 4/8 wide loads are always safe
+////////////////////////////////////////////////////////////////////////
+#define VEC3_SOA_WIDTH 8
+#define VEC3_SOA_ALIGNMENT 32
+
+typedef struct
+{
+    float *x;
+    float *y;
+    float *z;
+    int count;        // Number of valid positions
+    int padded_count; // Number of allocated lanes (count rounded up to VEC3_SOA_WIDTH)
+    void *memory;     // Unaligned block that owns the x, y and z arrays
+} vec3_soa_t;
+
 ////////////////////////////////////////////////////////////////////////
 // Vec2D
 ////////////////////////////////////////////////////////////////////////
@@ -58,3 +76,10 @@ vec3_t vec3_from_vec4(vec4_t v);
 ////////////////////////////////////////////////////////////////////////
 
 vec4_t vec4_from_vec3(vec3_t v);
+
+////////////////////////////////////////////////////////////////////////
+// Vec3 SoA
+////////////////////////////////////////////////////////////////////////
+
+vec3_soa_t vec3_soa_from_array(vec3_t *vertices, int count);
+void vec3_soa_free(vec3_soa_t *soa);